@@ -22,16 +22,36 @@
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Utils/UnifyFunctionExitNodes.h"
 #include "llvm/Analysis/DominanceFrontier.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 
 #include "llvm/ADT/Statistic.h"
 #include <limits>
@@ -42,6 +62,8 @@
 #include <vector>
 #include <queue>
 #include <stack>
+#include <map>
+#include <set>
 
 using std::unordered_map;
 using std::unordered_set;
@@ -58,7 +80,180 @@ using std::stack;
 /* *******Implementation Ends Here******* */
 using namespace llvm;
 
+static cl::opt<bool> LatestCut("spgvnpre-late-cut", cl::init(false),
+    cl::Hidden,
+    cl::desc("Among the minimum cuts choose the one closest to the sink, "
+             "placing speculative computations as late as possible"));
+
+static cl::opt<bool> TTICost("spgvnpre-tti-cost", cl::init(false),
+    cl::Hidden,
+    cl::desc("Weight flow capacities with the TargetTransformInfo cost of each "
+             "expression: execution cost per execution plus code size per copy"));
+
+static cl::opt<unsigned> SizeWeight("spgvnpre-size-weight", cl::init(64),
+    cl::Hidden,
+    cl::desc("Executions one unit of code size is worth when the function is "
+             "optimized for size"));
+
+static cl::opt<bool> SizeMode("spgvnpre-size-mode", cl::init(false),
+    cl::Hidden,
+    cl::desc("Place every function as if it were optimized for size, so flow "
+             "capacities include the code size of each copy"));
+
+static cl::opt<unsigned> GrowthBudget("spgvnpre-growth-budget", cl::init(0),
+    cl::Hidden,
+    cl::desc("Code size, in TargetTransformInfo size units, that insertion "
+             "may add to one function (0 for no limit)"));
+
+static cl::opt<unsigned> ModuleGrowthBudget("spgvnpre-module-growth-budget",
+    cl::init(0), cl::Hidden,
+    cl::desc("Code size that insertion may add to the whole module (0 for no "
+             "limit)"));
+
+static cl::opt<bool> PressureVeto("spgvnpre-pressure", cl::init(false),
+    cl::Hidden,
+    cl::desc("Reject speculation that would keep more values live in a hot "
+             "block than its register class has registers"));
+
+static cl::opt<bool> VectorizerFriendly("spgvnpre-vectorizer-friendly",
+    cl::init(false), cl::Hidden,
+    cl::desc("Only speculate into the preheaders of loops the loop vectorizer "
+             "is likely to take, so their bodies keep a countable shape"));
+
+static cl::opt<bool> GuardTraps("spgvnpre-guard-traps", cl::init(false),
+    cl::Hidden,
+    cl::desc("Speculate integer divisions that may trap by selecting a safe "
+             "divisor on paths where the original division does not execute"));
+
+static cl::opt<bool> LoadPRE("spgvnpre-load-pre", cl::init(false),
+    cl::Hidden,
+    cl::desc("Number simple loads by address and MemorySSA clobber so they "
+             "take part in speculative PRE"));
+
+static cl::opt<bool> CallPRE("spgvnpre-call-pre", cl::init(false),
+    cl::Hidden,
+    cl::desc("Number calls to readnone and readonly functions and intrinsics "
+             "by callee, arguments and memory state"));
+
+static cl::opt<bool> SimplifyExprs("spgvnpre-simplify", cl::init(false),
+    cl::Hidden,
+    cl::desc("Constant fold and simplify expressions while numbering them, "
+             "and give them the number of the simplified value"));
+
+static cl::opt<unsigned> MaxTranslateDepth("spgvnpre-max-translate-depth",
+    cl::init(4), cl::Hidden,
+    cl::desc("Maximum nesting of expressions created by phi translation, "
+             "bounding ANTIC_IN around loops"));
+
+static cl::opt<bool> SCEVNumbering("spgvnpre-scev", cl::init(false),
+    cl::Hidden,
+    cl::desc("Give integer and address computations with the same "
+             "ScalarEvolution expression the same value number"));
+
+static cl::opt<bool> Reassociate("spgvnpre-reassociate", cl::init(false),
+    cl::Hidden,
+    cl::desc("Reassociate expression trees by operand rank before numbering so "
+             "loop invariant subexpressions group together"));
+
+static cl::opt<bool> ReassociateFP("spgvnpre-reassociate-fp", cl::init(false),
+    cl::Hidden,
+    cl::desc("Also reassociate floating point trees that carry the reassoc and "
+             "nsz fast-math flags"));
+
+static cl::opt<bool> OptimisticPhis("spgvnpre-optimistic-phis", cl::init(false),
+    cl::Hidden,
+    cl::desc("Find congruent PHIs optimistically, iterating over loop-carried "
+             "cycles to a fixed point, and give them one value number"));
+
+static cl::opt<bool> PhiOfOps("spgvnpre-phi-of-ops", cl::init(false),
+    cl::Hidden,
+    cl::desc("Number phi(a+c, b+c) like phi(a, b)+c and replace the matching "
+             "operations on the PHI by the PHI of operations"));
+
+static cl::opt<bool> PredicateVN("spgvnpre-predicates", cl::init(false),
+    cl::Hidden,
+    cl::desc("Use the conditions of dominating branches to fold compares and "
+             "values by value number, then fold branches on known conditions"));
+
+static cl::opt<bool> StrengthReduce("spgvnpre-strength-reduce", cl::init(false),
+    cl::Hidden,
+    cl::desc("Replace multiplications of induction variables by a PHI that is "
+             "incremented on the back edges, where the profile says it pays"));
+
+static cl::opt<unsigned> MulCost("spgvnpre-mul-cost", cl::init(3), cl::Hidden,
+    cl::desc("Cost of a multiplication in additions, for strength reduction"));
+
+static cl::opt<unsigned> ColdPercent("spgvnpre-cold-percent", cl::init(5),
+    cl::Hidden,
+    cl::desc("Insertion edges taken at most this percentage of the time get "
+             "their compensation block marked cold and moved to the end of "
+             "the function"));
+
+static cl::opt<bool> OutlineCold("spgvnpre-outline-cold", cl::init(false),
+    cl::Hidden,
+    cl::desc("Tag cold compensation blocks for -spgvnco, which outlines "
+             "them into cold noinline functions"));
+
+static cl::opt<bool> StoreSinking("spgvnpde-stores", cl::init(true),
+    cl::Hidden,
+    cl::desc("Merge stores to one address at joins, delete stores that are "
+             "overwritten on every path and sink partially dead stores"));
+
+static cl::opt<unsigned> SuperblockBudget("spgvnsb-budget", cl::init(64),
+    cl::Hidden,
+    cl::desc("Instructions spgvnsb may duplicate per function"));
+
+static cl::opt<unsigned> SuperblockHotPercent("spgvnsb-hot-percent", cl::init(70),
+    cl::Hidden,
+    cl::desc("Share of a merge block's frequency its hot predecessor must "
+             "carry for spgvnsb to duplicate the block for the other ones"));
+
+static cl::opt<bool> VersionLoops("spgvnsb-version-loops", cl::init(false),
+    cl::Hidden,
+    cl::desc("Version loops whose header PHIs change only on rare edges into "
+             "a fast copy where they are invariant, leaving to the original "
+             "loop on those edges"));
+
+static cl::opt<unsigned> RarePercent("spgvnsb-rare-percent", cl::init(1),
+    cl::Hidden,
+    cl::desc("Share of the header frequency below which spgvnsb treats the "
+             "edges redefining a header PHI as rare"));
+
+static cl::opt<bool> JointPlacement("spgvnpre-joint-cut", cl::init(false),
+    cl::Hidden,
+    cl::desc("Place dependent value numbers with a single min-cut over the "
+             "expression DAG instead of one cut per value number"));
+
+/// createdDepth - Returns how deeply V nests expressions that phi_translate
+/// created outside the function, or 0 for values of the function itself.
+static unsigned createdDepth(Value* V) {
+  Instruction* I = dyn_cast<Instruction>(V);
+  if (!I || I->getParent() || isa<PHINode>(I))
+    return 0;
+  unsigned depth = 0;
+  for (Value* op : I->operands())
+    depth = std::max(depth, createdDepth(op));
+  return depth + 1;
+}
+/// isUnaryExpression - Numbered expressions with a single value operand
+static bool isUnaryExpression(Value* V) {
+  return isa<CastInst>(V) || isa<UnaryOperator>(V) || isa<FreezeInst>(V) ||
+         isa<ExtractValueInst>(V);
+}
 
+/// unsplittableEntry - Whether some edge into BB cannot be split, so nothing
+/// can be inserted on it: the unwind edges into an EH pad, the edges of
+/// indirectbr and callbr, and the edges that leave a catch funclet.
+static bool unsplittableEntry(BasicBlock* BB) {
+  if (BB->isEHPad())
+    return true;
+  for (BasicBlock* P : predecessors(BB)) {
+    Instruction* T = P->getTerminator();
+    if (isa<IndirectBrInst>(T) || isa<CallBrInst>(T) || isa<CatchReturnInst>(T))
+      return true;
+  }
+  return false;
+}
 
 //===----------------------------------------------------------------------===//
 //                         ValueTable Class
@@ -71,7 +266,7 @@ namespace {
 
 struct Expression {
 
-  enum ExpressionOpcode { ADD, SUB, MUL, UDIV, SDIV, FDIV, UREM, SREM, 
+  enum ExpressionOpcode { ADD, FADD, SUB, FSUB, MUL, FMUL, UDIV, SDIV, FDIV, UREM, SREM, 
                           FREM, SHL, LSHR, ASHR, AND, OR, XOR, ICMPEQ, 
                           ICMPNE, ICMPUGT, ICMPUGE, ICMPULT, ICMPULE, 
                           ICMPSGT, ICMPSGE, ICMPSLT, ICMPSLE, FCMPOEQ, 
@@ -80,7 +275,8 @@ struct Expression {
                           FCMPULT, FCMPULE, FCMPUNE, EXTRACT, INSERT,
                           SHUFFLE, SELECT, TRUNC, ZEXT, SEXT, FPTOUI,
                           FPTOSI, UITOFP, SITOFP, FPTRUNC, FPEXT, 
-                          PTRTOINT, INTTOPTR, BITCAST, GEP, EMPTY,
+                          PTRTOINT, INTTOPTR, BITCAST, GEP, LOAD, CALL, FNEG, FREEZE,
+                          EXTRACTVALUE, INSERTVALUE, EMPTY,
                           TOMBSTONE };
   ExpressionOpcode opcode;
   const Type* type;
@@ -166,7 +362,8 @@ namespace {
 
       struct Exequal{
         bool operator()(const Expression& E1, const Expression& E2) const{
-          bool result = E1.type->getTypeID() == E2.type->getTypeID()
+          bool result = E1.opcode == E2.opcode
+           && E1.type == E2.type
            && E1.firstVN==E2.firstVN && E1.secondVN == E2.secondVN && E1.thirdVN == E2.thirdVN
             && E1.varargs.size() == E2.varargs.size();
 
@@ -187,11 +384,17 @@ namespace {
 
       DenseMap<Value*, uint32_t> valueNumbering;
       unordered_map<Expression, uint32_t, Exhash, Exequal> expressionNumbering;
+      DenseMap<Instruction*, MemoryAccess*> memoryStates;
+      DenseMap<Value*, Value*> simplifiedValues;
+      DenseMap<std::pair<const SCEV*, Type*>, uint32_t> scevNumbering;
+      MemorySSA* MSSA;
+      const DataLayout* DL;
+      ScalarEvolution* SE;
   
       uint32_t nextValueNumber;
     
       Expression::ExpressionOpcode getOpcode(BinaryOperator* BO);
-      Expression::ExpressionOpcode getOpcode(CmpInst* C);
+      Expression::ExpressionOpcode getOpcode(CmpInst::Predicate P);
       Expression::ExpressionOpcode getOpcode(CastInst* C);
       Expression create_expression(BinaryOperator* BO);
       Expression create_expression(CmpInst* C);
@@ -201,10 +404,29 @@ namespace {
       Expression create_expression(SelectInst* V);
       Expression create_expression(CastInst* C);
       Expression create_expression(GetElementPtrInst* G);
+      Expression create_expression(LoadInst* L);
+      Expression create_expression(CallInst* C);
+      Expression create_expression(UnaryOperator* U);
+      Expression create_expression(FreezeInst* F);
+      Expression create_expression(ExtractValueInst* E);
+      Expression create_expression(InsertValueInst* I);
+      Value* simplify(Instruction* I);
+      const SCEV* scevOf(Value* V);
+      uint32_t number_expression(Value* V);
     public:
       ValueTable() { 
         nextValueNumber = 1; 
+        MSSA = 0;
+        DL = 0;
+        SE = 0;
         }
+      void setMemorySSA(MemorySSA* M) { MSSA = M; }
+      void setDataLayout(const DataLayout* D) { DL = D; }
+      void setScalarEvolution(ScalarEvolution* S) { SE = S; }
+      const DenseMap<Value*, Value*>& simplified() const { return simplifiedValues; }
+      bool numberedLoad(Value* V);
+      bool numberedCall(Value* V);
+      MemoryAccess* memoryState(Instruction* I);
       uint32_t lookup_or_add(Value* V);
       uint32_t lookup(Value* V) const;
       bool exists(Value* V) const{
@@ -242,10 +464,16 @@ Expression::ExpressionOpcode
     
     case Instruction::Add:
       return Expression::ADD;
+    case Instruction::FAdd:
+      return Expression::FADD;
     case Instruction::Sub:
       return Expression::SUB;
+    case Instruction::FSub:
+      return Expression::FSUB;
     case Instruction::Mul:
       return Expression::MUL;
+    case Instruction::FMul:
+      return Expression::FMUL;
     case Instruction::UDiv:
       return Expression::UDIV;
     case Instruction::SDiv:
@@ -278,9 +506,9 @@ Expression::ExpressionOpcode
       return Expression::ADD;
   }
 }
-Expression::ExpressionOpcode ValueTable::getOpcode(CmpInst* C) {
-  if (C->getOpcode() == Instruction::ICmp) {
-    switch (C->getPredicate()) {
+Expression::ExpressionOpcode ValueTable::getOpcode(CmpInst::Predicate P) {
+  if (CmpInst::isIntPredicate(P)) {
+    switch (P) {
       case ICmpInst::ICMP_EQ:
         return Expression::ICMPEQ;
       case ICmpInst::ICMP_NE:
@@ -308,7 +536,7 @@ Expression::ExpressionOpcode ValueTable::getOpcode(CmpInst* C) {
         return Expression::ICMPEQ;
     }
   } else {
-    switch (C->getPredicate()) {
+    switch (P) {
       case FCmpInst::FCMP_OEQ:
         return Expression::FCMPOEQ;
       case FCmpInst::FCMP_OGT:
@@ -388,6 +616,10 @@ Expression ValueTable::create_expression(BinaryOperator* BO) {
   e.type = BO->getType();
   e.opcode = getOpcode(BO);
   
+  // a+b and b+a get the same number
+  if (BO->isCommutative() && e.firstVN > e.secondVN)
+    std::swap(e.firstVN, e.secondVN);
+  
   return e;
 }
 Expression ValueTable::create_expression(CmpInst* C) {
@@ -397,7 +629,14 @@ Expression ValueTable::create_expression(CmpInst* C) {
   e.secondVN = lookup_or_add(C->getOperand(1));
   e.thirdVN = 0;
   e.type = C->getType();
-  e.opcode = getOpcode(C);
+  
+  // x > y and y < x get the same number
+  CmpInst::Predicate pred = C->getPredicate();
+  if (e.firstVN > e.secondVN) {
+    std::swap(e.firstVN, e.secondVN);
+    pred = CmpInst::getSwappedPredicate(pred);
+  }
+  e.opcode = getOpcode(pred);
   
   return e;
 }
@@ -471,9 +710,164 @@ Expression ValueTable::create_expression(GetElementPtrInst* G) {
   
   return e;
 }
+Expression ValueTable::create_expression(UnaryOperator* U) {
+  Expression e;
+    
+  e.firstVN = lookup_or_add(U->getOperand(0));
+  e.secondVN = 0;
+  e.thirdVN = 0;
+  e.type = U->getType();
+  e.opcode = Expression::FNEG;
+  
+  return e;
+}
+Expression ValueTable::create_expression(FreezeInst* F) {
+  Expression e;
+    
+  e.firstVN = lookup_or_add(F->getOperand(0));
+  e.secondVN = 0;
+  e.thirdVN = 0;
+  e.type = F->getType();
+  e.opcode = Expression::FREEZE;
+  
+  return e;
+}
+Expression ValueTable::create_expression(ExtractValueInst* E) {
+  Expression e;
+    
+  e.firstVN = lookup_or_add(E->getAggregateOperand());
+  e.secondVN = 0;
+  e.thirdVN = 0;
+  e.type = E->getType();
+  e.opcode = Expression::EXTRACTVALUE;
+  
+  for (unsigned idx : E->indices())
+    e.varargs.push_back(idx);
+  
+  return e;
+}
+Expression ValueTable::create_expression(InsertValueInst* I) {
+  Expression e;
+    
+  e.firstVN = lookup_or_add(I->getAggregateOperand());
+  e.secondVN = lookup_or_add(I->getInsertedValueOperand());
+  e.thirdVN = 0;
+  e.type = I->getType();
+  e.opcode = Expression::INSERTVALUE;
+  
+  for (unsigned idx : I->indices())
+    e.varargs.push_back(idx);
+  
+  return e;
+}
+Expression ValueTable::create_expression(CallInst* C) {
+  Expression e;
+    
+  e.firstVN = lookup_or_add(C->getCalledOperand());
+  MemoryAccess* state = memoryState(C);
+  e.secondVN = state ? lookup_or_add(state) : 0;
+  e.thirdVN = 0;
+  e.type = C->getType();
+  e.opcode = Expression::CALL;
+  
+  for (auto I = C->arg_begin(), E = C->arg_end(); I != E; ++I)
+    e.varargs.push_back(lookup_or_add(*I));
+  
+  // Commutative intrinsics such as smax and umin ignore the order of their
+  // first two arguments
+  if (IntrinsicInst* II = dyn_cast<IntrinsicInst>(C))
+    if (II->isCommutative() && e.varargs[0] > e.varargs[1])
+      std::swap(e.varargs[0], e.varargs[1]);
+  
+  return e;
+}
+Expression ValueTable::create_expression(LoadInst* L) {
+  Expression e;
+    
+  e.firstVN = lookup_or_add(L->getPointerOperand());
+  e.secondVN = lookup_or_add(memoryState(L));
+  e.thirdVN = 0;
+  e.type = L->getType();
+  e.opcode = Expression::LOAD;
+  
+  return e;
+}
 //===----------------------------------------------------------------------===//
 //                     ValueTable External Functions
 //===----------------------------------------------------------------------===//
+/// numberedLoad - Returns true if V is a simple load that is numbered by its
+/// address and memory state instead of being an opaque temporary
+bool ValueTable::numberedLoad(Value* V) {
+  LoadInst* L = dyn_cast<LoadInst>(V);
+  return LoadPRE && L && L->isSimple() && MSSA && L->getParent() &&
+         MSSA->getMemoryAccess(L);
+}
+/// numberedCall - Returns true if V is a call without side effects that
+/// only reads memory, numbered by callee, arguments and memory state. Calls
+/// that do not touch memory at all get no memory state, and are the only
+/// calls that phi_translate may create outside the function.
+bool ValueTable::numberedCall(Value* V) {
+  CallInst* C = dyn_cast<CallInst>(V);
+  if (!CallPRE || !C || !MSSA)
+    return false;
+  if (!C->onlyReadsMemory() || C->mayHaveSideEffects() || C->isConvergent() ||
+      C->isInlineAsm() || C->hasOperandBundles() || C->getType()->isVoidTy())
+    return false;
+  return C->doesNotAccessMemory() || (C->getParent() && MSSA->getMemoryAccess(C));
+}
+/// memoryState - Returns the MemorySSA access that clobbers a numbered load
+/// or call, or null if it does not read memory. Two reads of the same
+/// location with the same clobber see the same value.
+MemoryAccess* ValueTable::memoryState(Instruction* I) {
+  if (!I->getParent())
+    return 0;
+  
+  auto MI = memoryStates.find(I);
+  if (MI != memoryStates.end())
+    return MI->second;
+  
+  MemoryAccess* state = 0;
+  if (MSSA->getMemoryAccess(I))
+    state = MSSA->getWalker()->getClobberingMemoryAccess(I);
+  memoryStates.insert(std::make_pair(I, state));
+  return state;
+}
+/// simplify - Returns the constant or already numbered value that an
+/// expression folds to, or null. Loads and calls are left alone, as are
+/// expressions on other expressions that phi_translate created, since the
+/// analyses behind InstSimplify expect instructions inside a function.
+Value* ValueTable::simplify(Instruction* I) {
+  if (!SimplifyExprs || !DL || isa<PHINode>(I) || isa<LoadInst>(I) ||
+      isa<CallBase>(I) || I->mayHaveSideEffects())
+    return 0;
+  for (Value* op : I->operands())
+    if (Instruction* opI = dyn_cast<Instruction>(op))
+      if (!opI->getParent())
+        return 0;
+  
+  Value* S = SimplifyInstruction(I, SimplifyQuery(*DL, I->getParent() ? I : 0));
+  if (!S)
+    if (const SCEVConstant* C = dyn_cast_or_null<SCEVConstant>(scevOf(I)))
+      S = C->getValue();
+  if (!S || S == I)
+    return 0;
+  if (isa<Instruction>(S) && !exists(S))
+    return 0;
+  return S;
+}
+/// scevOf - Returns the ScalarEvolution expression of an integer or pointer
+/// instruction of the function, or null if it is opaque to ScalarEvolution.
+const SCEV* ValueTable::scevOf(Value* V) {
+  Instruction* I = dyn_cast<Instruction>(V);
+  if (!SCEVNumbering || !SE || !I || !I->getParent() ||
+      !SE->isSCEVable(I->getType()))
+    return 0;
+  
+  const SCEV* S = SE->getSCEV(I);
+  if (isa<SCEVUnknown>(S) || isa<SCEVCouldNotCompute>(S))
+    return 0;
+  return S;
+}
 /// lookup_or_add - Returns the value number for the specified value, assigning
 /// it a new number if it did not have one before.
 uint32_t ValueTable::lookup_or_add(Value* V) {
@@ -481,7 +875,35 @@ uint32_t ValueTable::lookup_or_add(Value* V) {
   if (VI != valueNumbering.end())
     return VI->second;
   
+  if (Instruction* I = dyn_cast<Instruction>(V))
+    if (Value* S = simplify(I)) {
+      uint32_t num = lookup_or_add(S);
+      valueNumbering.insert(std::make_pair(V, num));
+      simplifiedValues.insert(std::make_pair(V, S));
+      return num;
+    }
+  
+  // Values with the same affine recurrence or address computation are equal
+  // wherever both are defined, however their instructions are written.
+  // Pointers to different element types can share an expression.
+  const SCEV* S = scevOf(V);
+  std::pair<const SCEV*, Type*> key(S, V->getType());
+  if (S) {
+    auto SI = scevNumbering.find(key);
+    if (SI != scevNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, SI->second));
+      return SI->second;
+    }
+  }
   
+  uint32_t num = number_expression(V);
+  if (S)
+    scevNumbering.insert(std::make_pair(key, num));
+  return num;
+}
+/// number_expression - Numbers a value that was not numbered before by the
+/// structure of its expression.
+uint32_t ValueTable::number_expression(Value* V) {
   if (BinaryOperator* BO = dyn_cast<BinaryOperator>(V)) {
     Expression e = create_expression(BO);
     
@@ -576,6 +998,84 @@ uint32_t ValueTable::lookup_or_add(Value* V) {
   } else if (GetElementPtrInst* U = dyn_cast<GetElementPtrInst>(V)) {
     Expression e = create_expression(U);
     
+    auto EI = expressionNumbering.find(e);
+    if (EI != expressionNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, EI->second));
+      return EI->second;
+    } else {
+      expressionNumbering.insert(std::make_pair(e, nextValueNumber));
+      valueNumbering.insert(std::make_pair(V, nextValueNumber));
+      
+      return nextValueNumber++;
+    }
+  } else if (UnaryOperator* U = dyn_cast<UnaryOperator>(V)) {
+    Expression e = create_expression(U);
+    
+    auto EI = expressionNumbering.find(e);
+    if (EI != expressionNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, EI->second));
+      return EI->second;
+    } else {
+      expressionNumbering.insert(std::make_pair(e, nextValueNumber));
+      valueNumbering.insert(std::make_pair(V, nextValueNumber));
+      
+      return nextValueNumber++;
+    }
+  } else if (FreezeInst* U = dyn_cast<FreezeInst>(V)) {
+    Expression e = create_expression(U);
+    
+    auto EI = expressionNumbering.find(e);
+    if (EI != expressionNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, EI->second));
+      return EI->second;
+    } else {
+      expressionNumbering.insert(std::make_pair(e, nextValueNumber));
+      valueNumbering.insert(std::make_pair(V, nextValueNumber));
+      
+      return nextValueNumber++;
+    }
+  } else if (ExtractValueInst* U = dyn_cast<ExtractValueInst>(V)) {
+    Expression e = create_expression(U);
+    
+    auto EI = expressionNumbering.find(e);
+    if (EI != expressionNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, EI->second));
+      return EI->second;
+    } else {
+      expressionNumbering.insert(std::make_pair(e, nextValueNumber));
+      valueNumbering.insert(std::make_pair(V, nextValueNumber));
+      
+      return nextValueNumber++;
+    }
+  } else if (InsertValueInst* U = dyn_cast<InsertValueInst>(V)) {
+    Expression e = create_expression(U);
+    
+    auto EI = expressionNumbering.find(e);
+    if (EI != expressionNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, EI->second));
+      return EI->second;
+    } else {
+      expressionNumbering.insert(std::make_pair(e, nextValueNumber));
+      valueNumbering.insert(std::make_pair(V, nextValueNumber));
+      
+      return nextValueNumber++;
+    }
+  } else if (numberedLoad(V)) {
+    Expression e = create_expression(cast<LoadInst>(V));
+    
+    auto EI = expressionNumbering.find(e);
+    if (EI != expressionNumbering.end()) {
+      valueNumbering.insert(std::make_pair(V, EI->second));
+      return EI->second;
+    } else {
+      expressionNumbering.insert(std::make_pair(e, nextValueNumber));
+      valueNumbering.insert(std::make_pair(V, nextValueNumber));
+      
+      return nextValueNumber++;
+    }
+  } else if (numberedCall(V)) {
+    Expression e = create_expression(cast<CallInst>(V));
+    
     auto EI = expressionNumbering.find(e);
     if (EI != expressionNumbering.end()) {
       valueNumbering.insert(std::make_pair(V, EI->second));
@@ -614,11 +1114,15 @@ void ValueTable::add(Value* V, uint32_t num) {
 void ValueTable::clear() {
   valueNumbering.clear();
   expressionNumbering.clear();
+  memoryStates.clear();
+  simplifiedValues.clear();
+  scevNumbering.clear();
   nextValueNumber = 1;
 }
 /// erase - Remove a value from the value numbering
 void ValueTable::erase(Value* V) {
   valueNumbering.erase(V);
+  simplifiedValues.erase(V);
 }
 /// size - Return the number of assigned value numbers
 unsigned ValueTable::size() {
@@ -715,15 +1219,28 @@ namespace {
     DenseMap<BasicBlock*, ValueNumberedSet> generatedPhis;
 
     unordered_map<Value*, BasicBlock*> newValuePhiBB;
+
+    // Code size inserted into the module so far
+    uint64_t moduleGrowth = 0;
+
+    bool doInitialization(Module &) override {
+      moduleGrowth = 0;
+      return false;
+    }
     
-    // This transformation requires dominator postdominator info
+    // This transformation requires dominator postdominator info. Nothing is
+    // preserved, insertion splits edges and predicates fold branches.
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
-      AU.setPreservesCFG();
       AU.addRequiredID(BreakCriticalEdgesID);
       //AU.addRequired<UnifyFunctionExitNodes>();
       AU.addRequired<DominatorTreeWrapperPass>();
       AU.addRequired<BranchProbabilityInfoWrapperPass>();
       AU.addRequired<BlockFrequencyInfoWrapperPass>();
+      AU.addRequired<TargetTransformInfoWrapperPass>();
+      AU.addRequired<PostDominatorTreeWrapperPass>();
+      AU.addRequired<MemorySSAWrapperPass>();
+      AU.addRequired<LoopInfoWrapperPass>();
+      AU.addRequired<ScalarEvolutionWrapperPass>();
       
     }
   
@@ -816,6 +1333,36 @@ void SPGVNPRE::val_replace(ValueNumberedSet& s, Value* v) {
 
 
 void SPGVNPRE::myclean(ValueNumberedSet& set, BasicBlock* bb){
+  // The joint placement makes operands available together with their users,
+  // so an expression only dies with a PHI of this block or an operand of this
+  // block whose value number is not anticipated itself
+  if(JointPlacement){
+    bool changed = true;
+    while(changed){
+      changed = false;
+      SmallVector<Value*, 8> dead;
+      for(Value* vinset : set){
+        Instruction* IinSet = dyn_cast<Instruction>(vinset);
+        if(!IinSet)
+          continue;
+        for(unsigned i = 0; i<IinSet->getNumOperands(); i++){
+          Instruction* opI = dyn_cast<Instruction>(IinSet->getOperand(i));
+          if(opI && opI->getParent()==bb && (isa<PHINode>(opI) ||
+             !VN.exists(opI) || !set.test(VN.lookup(opI)))){
+            dead.push_back(vinset);
+            break;
+          }
+        }
+      }
+      for(Value* v : dead){
+        set.erase(v);
+        set.reset(VN.lookup(v));
+        changed = true;
+      }
+    }
+    return;
+  }
+
   auto it = bb->end();
   --it;
 
@@ -866,7 +1413,8 @@ void SPGVNPRE::clean(ValueNumberedSet& set) {
     Value* v = worklist[i];
     
     // Handle unary ops
-    if (CastInst* U = dyn_cast<CastInst>(v)) {
+    if (isUnaryExpression(v)) {
+      User* U = cast<User>(v);
       bool lhsValid = !isa<Instruction>(U->getOperand(0));
       lhsValid |= set.test(VN.lookup(U->getOperand(0)));
       if (lhsValid)
@@ -879,7 +1427,7 @@ void SPGVNPRE::clean(ValueNumberedSet& set) {
     
     // Handle binary ops
     } else if (isa<BinaryOperator>(v) || isa<CmpInst>(v) ||
-        isa<ExtractElementInst>(v)) {
+        isa<ExtractElementInst>(v) || isa<InsertValueInst>(v)) {
       User* U = cast<User>(v);
       
       bool lhsValid = !isa<Instruction>(U->getOperand(0));
@@ -941,6 +1489,34 @@ void SPGVNPRE::clean(ValueNumberedSet& set) {
         set.erase(U);
         set.reset(VN.lookup(U));
       }
+    
+    // Handle loads
+    } else if (VN.numberedLoad(v)) {
+      LoadInst* U = cast<LoadInst>(v);
+      bool ptrValid = !isa<Instruction>(U->getPointerOperand());
+      ptrValid |= set.test(VN.lookup(U->getPointerOperand()));
+      if (ptrValid)
+        ptrValid = !dependsOnInvoke(U->getPointerOperand());
+      
+      if (!ptrValid) {
+        set.erase(U);
+        set.reset(VN.lookup(U));
+      }
+    
+    // Handle calls
+    } else if (VN.numberedCall(v)) {
+      CallInst* U = cast<CallInst>(v);
+      bool argValid = true;
+      for (auto I = U->arg_begin(), E = U->arg_end(); I != E; ++I)
+        if (argValid) {
+          argValid &= !isa<Instruction>(*I) || set.test(VN.lookup(*I));
+          argValid &= !dependsOnInvoke(*I);
+        }
+      
+      if (!argValid) {
+        set.erase(U);
+        set.reset(VN.lookup(U));
+      }
     }
   }
 }
@@ -959,7 +1535,8 @@ void SPGVNPRE::topo_sort(ValueNumberedSet& set, SmallVector<Value*, 8>& vec) {
       Value* e = stack.back();
       
       // Handle unary ops
-      if (CastInst* U = dyn_cast<CastInst>(e)) {
+      if (isUnaryExpression(e)) {
+        User* U = cast<User>(e);
         Value* l = find_leader(set, VN.lookup(U->getOperand(0)));
     
         if (l != 0 && isa<Instruction>(l) &&
@@ -973,7 +1550,7 @@ void SPGVNPRE::topo_sort(ValueNumberedSet& set, SmallVector<Value*, 8>& vec) {
       
       // Handle binary ops
       } else if (isa<BinaryOperator>(e) || isa<CmpInst>(e) ||
-          isa<ExtractElementInst>(e)) {
+          isa<ExtractElementInst>(e) || isa<InsertValueInst>(e)) {
         User* U = cast<User>(e);
         Value* l = find_leader(set, VN.lookup(U->getOperand(0)));
         Value* r = find_leader(set, VN.lookup(U->getOperand(1)));
@@ -1038,6 +1615,37 @@ void SPGVNPRE::topo_sort(ValueNumberedSet& set, SmallVector<Value*, 8>& vec) {
           }
         }
       
+      // Handle loads
+      } else if (VN.numberedLoad(e)) {
+        Value* p = find_leader(set, VN.lookup(cast<LoadInst>(e)->getPointerOperand()));
+        
+        if (p != 0 && isa<Instruction>(p) &&
+            visited.count(p) == 0)
+          stack.push_back(p);
+        else {
+          vec.push_back(e);
+          visited.insert(e);
+          stack.pop_back();
+        }
+      
+      // Handle calls
+      } else if (VN.numberedCall(e)) {
+        CallInst* U = cast<CallInst>(e);
+        bool push_va = false;
+        for (auto I = U->arg_begin(), E = U->arg_end(); I != E; ++I) {
+          Value * v = find_leader(set, VN.lookup(*I));
+          if (v != 0 && isa<Instruction>(v) && visited.count(v) == 0) {
+            stack.push_back(v);
+            push_va = true;
+          }
+        }
+        
+        if (!push_va) {
+          vec.push_back(e);
+          visited.insert(e);
+          stack.pop_back();
+        }
+      
       // Handle opaque ops
       } else {
         visited.insert(e);
@@ -1076,9 +1684,14 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
     return 0;
   }
 
+  // Translating around a loop may create a new expression every round
+  if (createdDepth(V) >= MaxTranslateDepth)
+    return 0;
+
 
   // Unary Operations
-  if (CastInst* U = dyn_cast<CastInst>(V)) {
+  if (isUnaryExpression(V)) {
+    Instruction* U = cast<Instruction>(V);
     Value* newOp1 = 0;
     if (isa<Instruction>(U->getOperand(0)))
       newOp1 = phi_translate(U->getOperand(0), pred, succ);
@@ -1094,6 +1707,14 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
         newVal = CastInst::Create(C->getOpcode(),
                                   newOp1, C->getType(),
                                   C->getName()+".expr");
+      else if (UnaryOperator* UO = dyn_cast<UnaryOperator>(U))
+        newVal = UnaryOperator::Create(UO->getOpcode(), newOp1,
+                                       UO->getName()+".expr");
+      else if (FreezeInst* F = dyn_cast<FreezeInst>(U))
+        newVal = new FreezeInst(newOp1, F->getName()+".expr");
+      else if (ExtractValueInst* E = dyn_cast<ExtractValueInst>(U))
+        newVal = ExtractValueInst::Create(newOp1, E->getIndices(),
+                                          E->getName()+".expr");
       
       uint32_t v = VN.lookup_or_add(newVal);
       
@@ -1111,7 +1732,7 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
   
   // Binary Operations
   } if (isa<BinaryOperator>(V) || isa<CmpInst>(V) || 
-      isa<ExtractElementInst>(V)) {
+      isa<ExtractElementInst>(V) || isa<InsertValueInst>(V)) {
     User* U = cast<User>(V);
     
     Value* newOp1 = 0;
@@ -1145,6 +1766,9 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
                                  C->getName()+".expr");
       else if (ExtractElementInst* E = dyn_cast<ExtractElementInst>(U))
         newVal = ExtractElementInst::Create(newOp1, newOp2, E->getName()+".expr");
+      else if (InsertValueInst* IV = dyn_cast<InsertValueInst>(U))
+        newVal = InsertValueInst::Create(newOp1, newOp2, IV->getIndices(),
+                                         IV->getName()+".expr");
       
       uint32_t v = VN.lookup_or_add(newVal);
       
@@ -1240,6 +1864,8 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
          I != E; ++I)
       if (isa<Instruction>(*I)) {
         Value* newVal = phi_translate(*I, pred, succ);
+        if (newVal == 0)
+          return 0;
         newIdx.push_back(newVal);
         if (newVal != *I)
           changed_idx = true;
@@ -1248,7 +1874,7 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
       }
     
     if (newOp1 != U->getPointerOperand() || changed_idx) {
-          Instruction* newVal = GetElementPtrInst::Create(nullptr, newOp1, ArrayRef<Value *>(newIdx),
+          Instruction* newVal = GetElementPtrInst::Create(U->getSourceElementType(), newOp1, ArrayRef<Value *>(newIdx),
                                         U->getName()+".gvnpre");
       
       uint32_t v = VN.lookup_or_add(newVal);
@@ -1267,6 +1893,52 @@ Value* SPGVNPRE::phi_translate(Value* V, BasicBlock* pred, BasicBlock* succ) {
       }
     }
   
+  // Loads keep their memory state, so they only move to the predecessor when
+  // their address does not change
+  } else if (VN.numberedLoad(V)) {
+    LoadInst* L = cast<LoadInst>(V);
+    Value* ptr = L->getPointerOperand();
+    if (isa<Instruction>(ptr) && phi_translate(ptr, pred, succ) != ptr)
+      return 0;
+  
+  // Calls that read memory are not recreated either, their arguments have to
+  // stay the same. Readnone calls and intrinsics translate like any other
+  // expression.
+  } else if (VN.numberedCall(V)) {
+    CallInst* C = cast<CallInst>(V);
+    bool readNone = VN.memoryState(C) == 0;
+    SmallVector<Value*, 4> newArgs;
+    bool changed_arg = false;
+    for (auto I = C->arg_begin(), E = C->arg_end(); I != E; ++I) {
+      Value* newArg = *I;
+      if (isa<Instruction>(*I))
+        newArg = phi_translate(*I, pred, succ);
+      if (newArg == 0 || (newArg != *I && !readNone))
+        return 0;
+      changed_arg |= newArg != *I;
+      newArgs.push_back(newArg);
+    }
+    
+    if (changed_arg) {
+      CallInst* newVal = cast<CallInst>(C->clone());
+      newVal->setName(C->getName()+".expr");
+      for (unsigned i = 0; i < newArgs.size(); ++i)
+        newVal->setArgOperand(i, newArgs[i]);
+      
+      uint32_t v = VN.lookup_or_add(newVal);
+      
+      Value* leader = find_leader(availableOut[pred], v);
+      if (leader == 0) {
+        createdExpressions.push_back(newVal);
+        newValuePhiBB[newVal] = pred;
+        return newVal;
+      } else {
+        VN.erase(newVal);
+        newVal->deleteValue();
+        return leader;
+      }
+    }
+  
   // PHI Nodes
   } else if (PHINode* P = dyn_cast<PHINode>(V)) {
     if (P->getParent() == succ)
@@ -1303,7 +1975,8 @@ void SPGVNPRE::buildsets_availout(BasicBlock::iterator I,
     currPhis.set(num);
   
   // Handle unary ops
-  } else if (CastInst* U = dyn_cast<CastInst>(I)) {
+  } else if (isUnaryExpression(&*I)) {
+    User* U = cast<User>(I);
     Value* leftValue = U->getOperand(0);
     
     unsigned num = VN.lookup_or_add(U);
@@ -1321,7 +1994,7 @@ void SPGVNPRE::buildsets_availout(BasicBlock::iterator I,
   
   // Handle binary ops
   } else if (isa<BinaryOperator>(I) || isa<CmpInst>(I) ||
-             isa<ExtractElementInst>(I)) {
+             isa<ExtractElementInst>(I) || isa<InsertValueInst>(I)) {
     User* U = cast<User>(I);
     Value* leftValue = U->getOperand(0);
     Value* rightValue = U->getOperand(1);
@@ -1404,6 +2077,41 @@ void SPGVNPRE::buildsets_availout(BasicBlock::iterator I,
       currExps.set(num);
     }
     
+  // Handle loads
+  } else if (VN.numberedLoad(&*I)) {
+    LoadInst* U = cast<LoadInst>(I);
+    Value* ptrValue = U->getPointerOperand();
+    
+    unsigned num = VN.lookup_or_add(U);
+    
+    if (isa<Instruction>(ptrValue))
+      if (!currExps.test(VN.lookup(ptrValue))) {
+        currExps.insert(ptrValue);
+        currExps.set(VN.lookup(ptrValue));
+      }
+    
+    if (!currExps.test(num)) {
+      currExps.insert(U);
+      currExps.set(num);
+    }
+    
+  // Handle calls
+  } else if (VN.numberedCall(&*I)) {
+    CallInst* U = cast<CallInst>(I);
+    
+    unsigned num = VN.lookup_or_add(U);
+    
+    for (auto OI = U->arg_begin(), OE = U->arg_end(); OI != OE; ++OI)
+      if (isa<Instruction>(*OI) && !currExps.test(VN.lookup(*OI))) {
+        currExps.insert(*OI);
+        currExps.set(VN.lookup(*OI));
+      }
+    
+    if (!currExps.test(num)) {
+      currExps.insert(U);
+      currExps.set(num);
+    }
+    
   // Handle opaque ops
   } else if (!I->isTerminator()){
     VN.lookup_or_add(&*I);
@@ -1424,25 +2132,23 @@ void SPGVNPRE::buildsets_availout(BasicBlock::iterator I,
 bool SPGVNPRE::buildsets_anticout(BasicBlock* BB,
                                 ValueNumberedSet& anticOut,
                                 SmallPtrSet<BasicBlock*, 8>& visited) {
+  // Expressions anticipated behind an edge that cannot be split, such as the
+  // unwind edge of an invoke, cannot be placed on it, so they do not flow up
   if (BB->getTerminator()->getNumSuccessors() == 1) {
-    if (BB->getTerminator()->getSuccessor(0) != BB &&
-        visited.count(BB->getTerminator()->getSuccessor(0)) == 0) {
+    BasicBlock* succ = BB->getTerminator()->getSuccessor(0);
+    if (unsplittableEntry(succ))
+      return false;
+    if (succ != BB && visited.count(succ) == 0) {
       return true;
     }
     else {
-      phi_translate_set(anticipatedIn[BB->getTerminator()->getSuccessor(0)],
-                        BB,  BB->getTerminator()->getSuccessor(0), anticOut);
+      phi_translate_set(anticipatedIn[succ], BB, succ, anticOut);
     }
   } else if (BB->getTerminator()->getNumSuccessors() > 1) {
-    BasicBlock* first = BB->getTerminator()->getSuccessor(0);
-    for (ValueNumberedSet::iterator I = anticipatedIn[first].begin(),
-         E = anticipatedIn[first].end(); I != E; ++I) {
-      anticOut.insert(*I);
-      anticOut.set(VN.lookup(*I));
-    }
-    
-    for (unsigned i = 1; i < BB->getTerminator()->getNumSuccessors(); ++i) {
+    for (unsigned i = 0; i < BB->getTerminator()->getNumSuccessors(); ++i) {
       BasicBlock* currSucc = BB->getTerminator()->getSuccessor(i);
+      if (unsplittableEntry(currSucc))
+        continue;
       // ValueNumberedSet& succAnticIn = anticipatedIn[currSucc];
       
       // SmallVector<Value*, 16> temp;
@@ -1503,16 +2209,37 @@ unsigned SPGVNPRE::buildsets_anticin(BasicBlock* BB,
     }
   } 
   
+  // Opaque temporaries cannot be recomputed above their definition, so the
+  // value has to leave the set and not only its bit, otherwise the
+  // predecessors pick it up again from ANTIC_OUT
   for (SmallPtrSet<Value*, 16>::iterator I = currTemps.begin(),
        E = currTemps.end(); I != E; ++I) {
     
+    if (Value* leader = find_leader(anticIn, VN.lookup(*I)))
+      anticIn.erase(leader);
     anticIn.reset(VN.lookup(*I));
   }
   
   myclean(anticIn, BB);
-  anticOut.clear();
-  
-  if (old != anticIn.size()){
+
+  // Loads and readonly calls cannot move above the block that defines their
+  // memory state
+  SmallVector<Value*, 8> clobbered;
+  for (ValueNumberedSet::iterator I = anticIn.begin(),
+       E = anticIn.end(); I != E; ++I)
+    if (VN.numberedLoad(*I) || VN.numberedCall(*I)) {
+      MemoryAccess* state = VN.memoryState(cast<Instruction>(*I));
+      if (state && state->getBlock() == BB)
+        clobbered.push_back(*I);
+    }
+  for (Value* V : clobbered) {
+    anticIn.erase(V);
+    anticIn.reset(VN.lookup(V));
+  }
+
+  anticOut.clear();
+  
+  if (old != anticIn.size()){
     errs() << "new\n";
     anticIn.print();
 
@@ -1612,91 +2339,65 @@ void SPGVNPRE::cleanup() {
 
 
 namespace{
-  class ReducedFlowGraph{
-    vector<vector<long long>> graph;
-    unordered_map<BasicBlock*, int> BBtoNode;
-    unordered_map<int, BasicBlock*> NodetoBB;
-
-
-    public:
-
-    ReducedFlowGraph(vector<pair<BasicBlock*, BasicBlock*>> essentialEdges, 
-      BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry){
-
-      int nodeNum = 0;
-      for(auto edge : essentialEdges){
-        if(BBtoNode.find(edge.first) == BBtoNode.end()){
-          BBtoNode[edge.first] = nodeNum;
-          NodetoBB[nodeNum] = edge.first;
-          nodeNum++;
-        }
-        if(BBtoNode.find(edge.second) == BBtoNode.end()){
-          BBtoNode[edge.second] = nodeNum;
-          NodetoBB[nodeNum] = edge.second;
-          nodeNum++;
-        }
-      }
-
-      // 2 extra node for source (nodeNum) and sink (nodeNum+1)
-      graph = vector<vector<long long>>(nodeNum+2, vector<long long>(nodeNum+2, 0));
-
-      for(auto edge : essentialEdges){
-        BasicBlock* start = edge.first;
-        BasicBlock* dest = edge.second;
-        uint64_t blockFreq = bfi.getBlockFreq(start).getFrequency() / bfi.getBlockFreq(entry).getFrequency();
-        double branchProb =  bpi.getEdgeProbability(start,dest).getNumerator() 
-          / (double)bpi.getEdgeProbability(start,dest).getDenominator();
-
-        errs() << BBtoNode[start] << " " << start->getName() << " to " 
-        << BBtoNode[dest] << " " << dest->getName() << ": " << blockFreq << " " << branchProb << "\n";
-
-        graph[BBtoNode[start]][BBtoNode[dest]] = blockFreq * branchProb + 1;
-      }
-
-
-      for(int i=0; i<nodeNum; i++){
-        bool hasSucc = false;
-        bool hasPred = false;
-        for(int j=0; j<nodeNum; j++){
-          if(!hasSucc){
-            hasSucc = graph[i][j]!=0;
-          }
-          if(!hasPred){
-            hasPred = graph[j][i]!=0;
-          }
-          if(hasPred && hasSucc)
-            break;
-        }
+  /// ExprCost - Cost of speculating one value number. Every execution of an
+  /// inserted copy costs dyn, every static copy costs stat. The default is the
+  /// plain profile weight plus one per copy.
+  struct ExprCost{
+    uint64_t dyn = 1;
+    uint64_t stat = 1;
+  };
 
-        if(!hasPred){
-          graph[nodeNum][i] = INT_MAX;
-        }
-        if(!hasSucc){
-          graph[i][nodeNum+1] = INT_MAX;
-        }
+  /// Capacity - Fixed-point flow capacity. Profile weights are kept in the
+  /// scale of the block frequencies (or profile counts) instead of being
+  /// divided down by the entry frequency, and all arithmetic saturates just
+  /// below InfiniteCapacity.
+  typedef uint64_t Capacity;
+  static const Capacity InfiniteCapacity = std::numeric_limits<uint64_t>::max();
+
+  /// FlowGraph - Dense capacity matrix plus the Edmonds-Karp max-flow used to
+  /// find minimum cuts. The last two nodes are always the source and the sink.
+  /// Edges with InfiniteCapacity are never saturated.
+  class FlowGraph{
+    protected:
+    vector<vector<Capacity>> graph;
+
+    /// Set by maxFlow when an augmenting path consists of infinite edges only,
+    /// in which case no finite cut exists.
+    bool unbounded = false;
+
+    /// edgeWeight - Profile weight of the CFG edge start -> dest. Real profile
+    /// counts are used when the function has them, block frequencies
+    /// otherwise. One execution per function entry (the entry count or the
+    /// entry frequency) is the unit of the per-copy cost.
+    static Capacity edgeWeight(BasicBlock* start, BasicBlock* dest,
+      BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry,
+      ExprCost cost = ExprCost()){
+      uint64_t blockFreq = bfi.getBlockFreq(start).getFrequency();
+      uint64_t unit = bfi.getEntryFreq();
+      Optional<uint64_t> count = bfi.getBlockProfileCount(start);
+      Optional<uint64_t> entryCount = bfi.getBlockProfileCount(entry);
+      if(count && entryCount && *entryCount > 0){
+        blockFreq = *count;
+        unit = *entryCount;
       }
+      BranchProbability branchProb = bpi.getEdgeProbability(start,dest);
+      uint64_t edgeFreq = branchProb.scale(blockFreq);
 
-      // for(auto it : BBtoNode){
-      //   errs() << it.first << " " << it.second << "\n";
-      // }
-
-      printGraph2();
+      errs() << start->getName() << " to " << dest->getName() << ": " << edgeFreq << " / " << unit << "\n";
 
+      Capacity weight = SaturatingMultiplyAdd(edgeFreq, cost.dyn, SaturatingMultiply(unit, cost.stat));
+      return std::min(weight, InfiniteCapacity-1);
     }
 
-    void printGraph(){
-      std::string p;
-      for(int i=0; i<graph.size()-2; i++){
-        // errs() << NodetoBB[i]->getName();
-        p = p + NodetoBB[i]->getName().str() + "\t";
-        for(int j=0; j<graph.size()-2; j++){
-          p = p + std::to_string(graph[i][j]) + "\t\t\t\t";
-        }
-        p = p + "\n";
-      }
-      errs() << p;
+    /// addCapacity - Saturating sum that keeps finite capacities finite.
+    static Capacity addCapacity(Capacity a, Capacity b){
+      if(a == InfiniteCapacity || b == InfiniteCapacity)
+        return InfiniteCapacity;
+      return std::min(SaturatingAdd(a, b), InfiniteCapacity-1);
     }
 
+    public:
+
     void printGraph2(){
       std::string p;
       for(int i=0; i<graph.size(); i++){
@@ -1711,7 +2412,7 @@ namespace{
       
     /* Returns true if there is a path from source 's' to sink 't' in
       residual graph. Also fills parent[] to store the path */
-    int bfs(vector<vector<long long>>& rGraph, int s, int t, int parent[])
+    int bfs(vector<vector<Capacity>>& rGraph, int s, int t, int parent[])
     {
         // Create a visited array and mark all vertices as not visited
         int V = rGraph.size();
@@ -1750,7 +2451,7 @@ namespace{
     // A DFS based function to find all reachable vertices from s.  The function
     // marks visited[i] as true if i is reachable from s.  The initial values in
     // visited[] must be false. We can also use BFS to find reachable vertices
-    void dfs(vector<vector<long long>>& rGraph, int s, bool visited[])
+    void dfs(vector<vector<Capacity>>& rGraph, int s, bool visited[])
     {
         visited[s] = true;
         for (int i = 0; i < rGraph.size(); i++)
@@ -1758,12 +2459,45 @@ namespace{
               dfs(rGraph, i, visited);
     }
       
-    long long min(long long a, long long b){
+    // Marks visited[i] as true if the sink t is reachable from i in the
+    // residual graph
+    void rdfs(vector<vector<Capacity>>& rGraph, int t, bool visited[])
+    {
+        visited[t] = true;
+        for (int i = 0; i < rGraph.size(); i++)
+          if (rGraph[i][t]>0 && !visited[i])
+              rdfs(rGraph, i, visited);
+    }
+
+    // Splits the nodes along a minimum cut of the residual graph. By default
+    // the source side is everything reachable from s, the cut closest to the
+    // source. With -spgvnpre-late-cut the sink side is everything that can
+    // still reach t, the cut closest to the sink, as in lazy code motion.
+    void sourceSide(vector<vector<Capacity>>& rGraph, bool inSource[])
+    {
+        int V = rGraph.size();
+        int s = V-2;
+        int t = V-1;
+        memset(inSource, false, sizeof(bool) * V);
+        if (!LatestCut) {
+          dfs(rGraph, s, inSource);
+          return;
+        }
+
+        bool reachesSink[V];
+        memset(reachesSink, false, sizeof(reachesSink));
+        rdfs(rGraph, t, reachesSink);
+        for (int i = 0; i < V; i++)
+          inSource[i] = !reachesSink[i];
+    }
+      
+    Capacity min(Capacity a, Capacity b){
       return a > b ? b : a;
     }
 
-    // Prints the minimum s-t cut
-    vector<pair<BasicBlock*, BasicBlock*>> minCut()
+    // Returns the residual graph after pushing the maximum flow from the
+    // source to the sink
+    vector<vector<Capacity>> maxFlow()
     {
         int s = graph.size()-2;
         int t = graph.size()-1;
@@ -1774,7 +2508,7 @@ namespace{
         // Create a residual graph and fill the residual graph with
         // given capacities in the original graph as residual capacities
         // in residual graph
-        vector<vector<long long>> rGraph = graph; // rGraph[i][j] indicates residual capacity of edge i-j
+        vector<vector<Capacity>> rGraph = graph; // rGraph[i][j] indicates residual capacity of edge i-j
 
         int parent[graph.size()];  // This array is filled by BFS and to store path
       
@@ -1784,31 +2518,150 @@ namespace{
             // Find minimum residual capacity of the edhes along the
             // path filled by BFS. Or we can say find the maximum flow
             // through the path found.
-            long long path_flow = INT_MAX;
+            Capacity path_flow = InfiniteCapacity;
             for (v=t; v!=s; v=parent[v])
             {
                 u = parent[v];
                 path_flow = min(path_flow, rGraph[u][v]);
             }
+
+            if (path_flow == InfiniteCapacity)
+            {
+                errs() << "unbounded flow, no finite cut\n";
+                unbounded = true;
+                break;
+            }
       
             // update residual capacities of the edges and reverse edges
             // along the path
             for (v=t; v != s; v=parent[v])
             {
                 u = parent[v];
-                rGraph[u][v] -= path_flow;
-                rGraph[v][u] += path_flow;
+                if (rGraph[u][v] != InfiniteCapacity)
+                  rGraph[u][v] -= path_flow;
+                rGraph[v][u] = addCapacity(rGraph[v][u], path_flow);
             }
         }
 
+        return rGraph;
+    }
+  };
+
+  class ReducedFlowGraph : public FlowGraph{
+    unordered_map<BasicBlock*, int> BBtoNode;
+    unordered_map<int, BasicBlock*> NodetoBB;
+
+
+    public:
+
+    ReducedFlowGraph(vector<pair<BasicBlock*, BasicBlock*>> essentialEdges, 
+      BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry,
+      ExprCost cost = ExprCost()){
+
+      int nodeNum = 0;
+      for(auto edge : essentialEdges){
+        if(BBtoNode.find(edge.first) == BBtoNode.end()){
+          BBtoNode[edge.first] = nodeNum;
+          NodetoBB[nodeNum] = edge.first;
+          nodeNum++;
+        }
+        if(BBtoNode.find(edge.second) == BBtoNode.end()){
+          BBtoNode[edge.second] = nodeNum;
+          NodetoBB[nodeNum] = edge.second;
+          nodeNum++;
+        }
+      }
+
+      // 2 extra node for source (nodeNum) and sink (nodeNum+1)
+      graph = vector<vector<Capacity>>(nodeNum+2, vector<Capacity>(nodeNum+2, 0));
+
+      for(auto edge : essentialEdges){
+        BasicBlock* start = edge.first;
+        BasicBlock* dest = edge.second;
+        graph[BBtoNode[start]][BBtoNode[dest]] = edgeWeight(start, dest, bpi, bfi, entry, cost);
+      }
+
+
+      for(int i=0; i<nodeNum; i++){
+        bool hasSucc = false;
+        bool hasPred = false;
+        for(int j=0; j<nodeNum; j++){
+          if(!hasSucc){
+            hasSucc = graph[i][j]!=0;
+          }
+          if(!hasPred){
+            hasPred = graph[j][i]!=0;
+          }
+          if(hasPred && hasSucc)
+            break;
+        }
+
+        if(!hasPred){
+          graph[nodeNum][i] = InfiniteCapacity;
+        }
+        if(!hasSucc){
+          graph[i][nodeNum+1] = InfiniteCapacity;
+        }
+      }
+
+      // for(auto it : BBtoNode){
+      //   errs() << it.first << " " << it.second << "\n";
+      // }
+
+      printGraph2();
+
+    }
+
+    void printGraph(){
+      std::string p;
+      for(int i=0; i<graph.size()-2; i++){
+        // errs() << NodetoBB[i]->getName();
+        p = p + NodetoBB[i]->getName().str() + "\t";
+        for(int j=0; j<graph.size()-2; j++){
+          p = p + std::to_string(graph[i][j]) + "\t\t\t\t";
+        }
+        p = p + "\n";
+      }
+      errs() << p;
+    }
+
+    /// weightOf - Total capacity of the given edges of the graph.
+    Capacity weightOf(vector<pair<BasicBlock*, BasicBlock*>>& edges){
+      Capacity weight = 0;
+      for(auto edge : edges){
+        auto from = BBtoNode.find(edge.first);
+        auto to = BBtoNode.find(edge.second);
+        if(from != BBtoNode.end() && to != BBtoNode.end())
+          weight = addCapacity(weight, graph[from->second][to->second]);
+      }
+      return weight;
+    }
+
+    /// sinkWeight - Capacity of the cut in front of the blocks that compute
+    /// the value, which is what leaving the computations alone costs.
+    Capacity sinkWeight(){
+      int sink = graph.size()-1;
+      Capacity weight = 0;
+      for(int i=0; i<sink-1; i++)
+        if(graph[i][sink] == InfiniteCapacity)
+          for(int j=0; j<sink-1; j++)
+            weight = addCapacity(weight, graph[j][i]);
+      return weight;
+    }
+
+    // Prints the minimum s-t cut
+    vector<pair<BasicBlock*, BasicBlock*>> minCut()
+    {
+        vector<vector<Capacity>> rGraph = maxFlow();
+
         int V = graph.size();
+        vector<pair<BasicBlock*, BasicBlock*>> cutedges;
+        if (unbounded)
+          return cutedges;
       
-        // Flow is maximum now, find vertices reachable from s
+        // Flow is maximum now, find vertices on the source side of the cut
         bool visited[V];
-        memset(visited, false, sizeof(visited));
-        dfs(rGraph, s, visited);
-
-        vector<pair<BasicBlock*, BasicBlock*>> cutedges;
+        sourceSide(rGraph, visited);
 
         // Print all edges that are from a reachable vertex to
         // non-reachable vertex in the original graph
@@ -1824,6 +2677,118 @@ namespace{
 
   };
 
+  /// JointReducedFlowGraph - One flow network for a group of value numbers
+  /// that depend on each other. Every value number gets its own copy of its
+  /// reduced flow graph (a layer), and an infinite edge from the operand's node
+  /// to the user's node of the same block forbids cuts where the user becomes
+  /// available in a block the operand does not reach. A single min-cut then
+  /// minimizes the combined weight of all layers.
+  class JointReducedFlowGraph : public FlowGraph{
+    std::map<pair<int, BasicBlock*>, int> KeytoNode;
+    vector<pair<int, BasicBlock*>> NodetoKey;
+
+    int getNode(int vn, BasicBlock* bb){
+      auto key = pair<int, BasicBlock*>(vn, bb);
+      auto it = KeytoNode.find(key);
+      if(it != KeytoNode.end())
+        return it->second;
+      KeytoNode[key] = NodetoKey.size();
+      NodetoKey.push_back(key);
+      return NodetoKey.size()-1;
+    }
+
+    public:
+
+    JointReducedFlowGraph(std::map<int, vector<pair<BasicBlock*, BasicBlock*>>>& layers,
+      std::map<int, SmallVector<int, 4>>& operands, std::map<int, ExprCost>& costs,
+      BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry){
+
+      for(auto& layer : layers){
+        for(auto edge : layer.second){
+          getNode(layer.first, edge.first);
+          getNode(layer.first, edge.second);
+        }
+      }
+
+      int nodeNum = NodetoKey.size();
+      // 2 extra node for source (nodeNum) and sink (nodeNum+1)
+      graph = vector<vector<Capacity>>(nodeNum+2, vector<Capacity>(nodeNum+2, 0));
+
+      for(auto& layer : layers){
+        for(auto edge : layer.second){
+          graph[getNode(layer.first, edge.first)][getNode(layer.first, edge.second)]
+            = edgeWeight(edge.first, edge.second, bpi, bfi, entry, costs[layer.first]);
+        }
+      }
+
+      // Every layer is attached to the source and the sink exactly like a
+      // standalone ReducedFlowGraph, before the dependence edges are added
+      vector<bool> hasSucc(nodeNum, false), hasPred(nodeNum, false);
+      for(int i=0; i<nodeNum; i++){
+        for(int j=0; j<nodeNum; j++){
+          if(graph[i][j]!=0){
+            hasSucc[i] = true;
+            hasPred[j] = true;
+          }
+        }
+      }
+      for(int i=0; i<nodeNum; i++){
+        if(!hasPred[i]){
+          graph[nodeNum][i] = InfiniteCapacity;
+        }
+        if(!hasSucc[i]){
+          graph[i][nodeNum+1] = InfiniteCapacity;
+        }
+      }
+
+      for(int i=0; i<nodeNum; i++){
+        int vn = NodetoKey[i].first;
+        for(int op : operands[vn]){
+          auto it = KeytoNode.find(pair<int, BasicBlock*>(op, NodetoKey[i].second));
+          if(it != KeytoNode.end())
+            graph[it->second][i] = InfiniteCapacity;
+        }
+      }
+
+      printGraph2();
+    }
+
+    // Returns the cut edges of every layer, keyed by value number. Blocks on
+    // the sink side of the cut, where the value is available after insertion,
+    // are recorded in availableAfter.
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> minCut(
+      std::set<pair<int, BasicBlock*>>& availableAfter)
+    {
+        vector<vector<Capacity>> rGraph = maxFlow();
+
+        int V = graph.size();
+        std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cutedges;
+        if (unbounded)
+          return cutedges;
+
+        bool visited[V];
+        sourceSide(rGraph, visited);
+
+        for (int i = 0; i < V-2; i++)
+          if (!visited[i])
+            availableAfter.insert(NodetoKey[i]);
+
+        // Only edges inside a layer are insertion points, the source, sink and
+        // dependence edges are never part of a finite cut
+        for (int i = 0; i < V-2; i++)
+          for (int j = 0; j < V-2; j++)
+            if (visited[i] && !visited[j] && graph[i][j]>0
+                && NodetoKey[i].first == NodetoKey[j].first){
+                  errs() << NodetoKey[i].first << ": " << NodetoKey[i].second->getName()
+                    << " - " << NodetoKey[j].second->getName() << "\n";
+                  cutedges[NodetoKey[i].first].push_back(
+                    pair<BasicBlock*, BasicBlock*>(NodetoKey[i].second, NodetoKey[j].second));
+            }
+
+        return cutedges;
+    }
+  };
+
 
   vector<unordered_set<BasicBlock*>> getValueSet(ValueTable& VN, DenseMap<BasicBlock*, ValueNumberedSet>& map){
     vector<unordered_set<BasicBlock*>> valueSets = vector<unordered_set<BasicBlock*>>(VN.size());
@@ -1996,37 +2961,1152 @@ namespace{
 
   }
 
-}
-
-
-
-bool SPGVNPRE::runOnFunction(Function &F) {
-  errs() << F.getName() << " begin\n";
-  BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(); 
-  BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-  // Clean out global sets from any previous functions
-  VN.clear();
-  createdExpressions.clear();
-  availableOut.clear();
-  anticipatedIn.clear();
-  generatedPhis.clear();
- 
-  bool changed_function = false;
-  
-  // Phase 1: BuildSets
-  // This phase calculates the AVAIL_OUT and ANTIC_IN sets
-  buildsets(F);
-
-  errs() << "avaiableOut for each Basic Block \n";
-  for(auto it = availableOut.begin(); it!=availableOut.end(); ++it){
-    errs() << "Block: " << it->first->getName() << "\n";
-    it->second.print(VN);
+  /// operandNumbers - Value numbers of the instruction operands of the
+  /// expressions with value number vn.
+  SmallVector<int, 4> operandNumbers(ValueTable& VN, vector<Value*>& values, int vn){
+    SmallVector<int, 4> result;
+    for(Value* v : values){
+      Instruction* I = dyn_cast<Instruction>(v);
+      if(!I || isa<PHINode>(I))
+        continue;
+      for(unsigned i=0; i<I->getNumOperands(); i++){
+        Value* op = I->getOperand(i);
+        if(isa<Instruction>(op) && VN.exists(op)){
+          int opvn = VN.lookup(op);
+          if(opvn != vn && std::find(result.begin(), result.end(), opvn) == result.end())
+            result.push_back(opvn);
+        }
+      }
+    }
+    return result;
   }
 
-  errs() << "anticipateIn for each Basic Block \n";
-  for(auto it = anticipatedIn.begin(); it!=anticipatedIn.end(); ++it){
-    errs() << "Block: " << it->first->getName() << "\n";
-    it->second.print(VN);
+  /// expressionCost - TargetTransformInfo cost of the expressions with one
+  /// value number. Speed mode charges the execution cost per execution and the
+  /// size per copy, size mode additionally scales the size by
+  /// -spgvnpre-size-weight. The execution cost is the reciprocal throughput,
+  /// since the latency model returns 1 for every integer operation.
+  ExprCost expressionCost(vector<Value*>& values, TargetTransformInfo& TTI, bool optSize){
+    ExprCost cost;
+    for(Value* v : values){
+      Instruction* I = dyn_cast<Instruction>(v);
+      if(!I || isa<PHINode>(I))
+        continue;
+      InstructionCost exec = TTI.getInstructionCost(I, TargetTransformInfo::TCK_RecipThroughput);
+      InstructionCost size = TTI.getInstructionCost(I, TargetTransformInfo::TCK_CodeSize);
+      if(exec.isValid())
+        cost.dyn = std::max<int64_t>(1, *exec.getValue());
+      if(size.isValid())
+        cost.stat = std::max<int64_t>(1, *size.getValue());
+      if(optSize)
+        cost.stat *= SizeWeight;
+      break;
+    }
+    return cost;
+  }
+
+  /// isGuardable - Integer divisions, whose only trap can be avoided by
+  /// replacing the divisor.
+  bool isGuardable(Instruction* I){
+    switch(I->getOpcode()){
+      case Instruction::SDiv:
+      case Instruction::UDiv:
+      case Instruction::SRem:
+      case Instruction::URem:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /// speculationSafe - Whether the expressions with one value number may be
+  /// computed on paths that did not compute them before. Every member has to
+  /// qualify, since any of them may be the one that is cloned. Trapping
+  /// divisions qualify only when -spgvnpre-guard-traps lets them be guarded.
+  bool speculationSafe(vector<Value*>& values){
+    for(Value* v : values){
+      Instruction* I = dyn_cast<Instruction>(v);
+      if(!I || isa<PHINode>(I) || isSafeToSpeculativelyExecute(I))
+        continue;
+      if(!GuardTraps || !isGuardable(I))
+        return false;
+    }
+    return true;
+  }
+
+  /// restrictToDownSafe - Keep only the anticipation points of a value number
+  /// from which one of its occurrences that cannot be speculated, a load, a
+  /// call or a division that may trap, is reached on every path. Its block
+  /// has to postdominate the point, and every instruction from the point up
+  /// to it has to pass control on, so a call that may exit, throw or loop
+  /// forever in between stops it from anchoring. An insertion there then
+  /// only moves a computation that would execute anyway. Invokes are
+  /// terminators and never anchor anything.
+  void restrictToDownSafe(unordered_set<BasicBlock*>& panti, vector<Value*>& values,
+    PostDominatorTree& PDT){
+    SmallVector<Instruction*, 4> anchors;
+    for(Value* v : values){
+      Instruction* I = dyn_cast<Instruction>(v);
+      if(I && I->getParent() && !isa<PHINode>(I) && !I->isTerminator() &&
+         !isSafeToSpeculativelyExecute(I))
+        anchors.push_back(I);
+    }
+
+    // Whether control that enters BB reaches the anchor I
+    auto reaches = [&](BasicBlock* BB, Instruction* I){
+      BasicBlock* anchorBB = I->getParent();
+      if(!PDT.dominates(anchorBB, BB))
+        return false;
+      for(Instruction& J : *anchorBB){
+        if(&J == I)
+          break;
+        if(!isGuaranteedToTransferExecutionToSuccessor(&J))
+          return false;
+      }
+      // The blocks on the way, which all lead to the anchor's block
+      SmallPtrSet<BasicBlock*, 8> visited;
+      SmallVector<BasicBlock*, 8> worklist;
+      if(BB != anchorBB){
+        visited.insert(BB);
+        worklist.push_back(BB);
+      }
+      while(!worklist.empty()){
+        BasicBlock* B = worklist.pop_back_val();
+        if(!isGuaranteedToTransferExecutionToSuccessor(B))
+          return false;
+        for(BasicBlock* S : successors(B))
+          if(S != anchorBB && visited.insert(S).second)
+            worklist.push_back(S);
+      }
+      return true;
+    };
+
+    for(auto it = panti.begin(); it != panti.end();){
+      bool downSafe = false;
+      for(Instruction* I : anchors)
+        downSafe = downSafe || reaches(*it, I);
+      if(downSafe)
+        ++it;
+      else
+        it = panti.erase(it);
+    }
+  }
+
+  /// setProfileWeights - Record the branch probabilities of T as branch
+  /// weights unless it already has them, so the passes after this one, which
+  /// no longer see the estimate, still know which successors are cold.
+  void setProfileWeights(Instruction* T, BranchProbabilityInfo& bpi){
+    if(T->getNumSuccessors() < 2 || T->getMetadata(LLVMContext::MD_prof) ||
+       (!isa<BranchInst>(T) && !isa<SwitchInst>(T)))
+      return;
+    SmallVector<uint32_t, 4> weights;
+    for(unsigned i=0; i<T->getNumSuccessors(); i++)
+      weights.push_back(bpi.getEdgeProbability(T->getParent(), i).getNumerator());
+    T->setMetadata(LLVMContext::MD_prof, MDBuilder(T->getContext()).createBranchWeights(weights));
+  }
+
+  /// guardDivision - Replace the divisor of the speculative division I by 1
+  /// whenever I would trap. Where the original division executes it does not
+  /// trap, so the divisor and the result stay the same there.
+  void guardDivision(Instruction* I){
+    IRBuilder<> builder(I);
+    Value* dividend = I->getOperand(0);
+    Value* divisor = I->getOperand(1);
+    Type* ty = divisor->getType();
+
+    Value* trap = builder.CreateICmpEQ(divisor, Constant::getNullValue(ty), "guard");
+    if(I->getOpcode() == Instruction::SDiv || I->getOpcode() == Instruction::SRem){
+      Value* minDividend = builder.CreateICmpEQ(dividend,
+        ConstantInt::get(ty, APInt::getSignedMinValue(ty->getScalarSizeInBits())));
+      Value* minusOne = builder.CreateICmpEQ(divisor, Constant::getAllOnesValue(ty));
+      trap = builder.CreateOr(trap, builder.CreateAnd(minDividend, minusOne), "guard");
+    }
+    I->setOperand(1, builder.CreateSelect(trap, ConstantInt::get(ty, 1), divisor, "guard"));
+  }
+
+  /// jointPlacement - Compute the insertion edges of all value numbers with a
+  /// dependency-aware min-cut. Value numbers are grouped into connected
+  /// components of the expression DAG and each component is solved as one
+  /// JointReducedFlowGraph. A value number is dropped when one of its operands
+  /// would still be unavailable at one of its cut edges, and so is everything
+  /// that depends on it.
+  void jointPlacement(ValueTable& VN, unordered_map<int, vector<Value*>>& numberToValues,
+    vector<unordered_set<BasicBlock*>>& availValueSets,
+    vector<unordered_set<BasicBlock*>>& pantiValueSets,
+    std::map<int, ExprCost>& costs,
+    BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry,
+    unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>& insertSets){
+
+    int numVN = VN.size();
+    vector<vector<pair<BasicBlock*, BasicBlock*>>> essentialEdges(numVN);
+    std::map<int, SmallVector<int, 4>> operands;
+    for(int i=0; i<numVN; i++){
+      essentialEdges[i] = findEssentialEdge(availValueSets[i], pantiValueSets[i]);
+      operands[i] = operandNumbers(VN, numberToValues[i], i);
+    }
+
+    // Union the value numbers that take part in the flow problem with the
+    // operands they depend on
+    vector<int> leader(numVN);
+    for(int i=0; i<numVN; i++)
+      leader[i] = i;
+    std::function<int(int)> find = [&](int x){
+      return leader[x] == x ? x : leader[x] = find(leader[x]);
+    };
+    for(int i=0; i<numVN; i++){
+      if(essentialEdges[i].empty())
+        continue;
+      for(int op : operands[i])
+        if(!essentialEdges[op].empty())
+          leader[find(op)] = find(i);
+    }
+
+    std::map<int, vector<int>> components;
+    for(int i=0; i<numVN; i++)
+      if(!essentialEdges[i].empty())
+        components[find(i)].push_back(i);
+
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cuts;
+    std::set<pair<int, BasicBlock*>> availableAfter;
+    for(auto& component : components){
+      LLVM_DEBUG(dbgs() << "joint component of " << component.second.size()
+                        << " value numbers\n");
+      std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> layers;
+      for(int vn : component.second)
+        layers[vn] = essentialEdges[vn];
+
+      JointReducedFlowGraph JRFG(layers, operands, costs, bpi, bfi, entry);
+      for(auto& cut : JRFG.minCut(availableAfter))
+        cuts[cut.first] = cut.second;
+    }
+
+    // Drop value numbers whose operands cannot be provided at a cut edge,
+    // until nothing changes
+    unordered_set<int> dropped;
+    bool changed = true;
+    while(changed){
+      changed = false;
+      for(auto& cut : cuts){
+        int vn = cut.first;
+        if(dropped.count(vn))
+          continue;
+        for(auto edge : cut.second){
+          bool valid = true;
+          for(int op : operands[vn]){
+            if(availValueSets[op].count(edge.first))
+              continue;
+            if(dropped.count(op)){
+              valid = false;
+              break;
+            }
+            bool cutTogether = std::find(cuts[op].begin(), cuts[op].end(), edge) != cuts[op].end();
+            if(!cutTogether && !availableAfter.count(pair<int, BasicBlock*>(op, edge.first))){
+              valid = false;
+              break;
+            }
+          }
+          if(!valid){
+            LLVM_DEBUG(dbgs() << "joint: drop " << vn << "\n");
+            dropped.insert(vn);
+            changed = true;
+            break;
+          }
+        }
+      }
+    }
+
+    for(auto& cut : cuts){
+      if(dropped.count(cut.first))
+        continue;
+      for(auto edge : cut.second)
+        insertSets[edge].push_back(cut.first);
+    }
+
+    // Operands have to be cloned before their users on a shared edge. Value
+    // numbers need not follow that order, so they are ranked by a
+    // depth-first walk that visits the operands first.
+    vector<int> rank(numVN, -1);
+    int next = 0;
+    std::function<void(int)> visit = [&](int vn){
+      if(rank[vn] != -1)
+        return;
+      rank[vn] = numVN;
+      for(int op : operands[vn])
+        visit(op);
+      rank[vn] = next++;
+    };
+    for(auto& cut : cuts)
+      visit(cut.first);
+    for(auto& insertSet : insertSets)
+      std::sort(insertSet.second.begin(), insertSet.second.end(),
+        [&](int a, int b){ return rank[a] < rank[b]; });
+  }
+
+  /// cutsOf - The insertion edges of every value number in insertSets.
+  std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cutsOf(
+    unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>& insertSets){
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cuts;
+    for(auto& insertSet : insertSets)
+      for(int n : insertSet.second)
+        cuts[n].push_back(insertSet.first);
+    return cuts;
+  }
+
+  /// insertionProfits - What each cut saves over leaving the computations
+  /// where they are: the capacity of the cut in front of the computing
+  /// blocks minus the capacity of the cut, in the weights of the placement.
+  std::map<int, double> insertionProfits(
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>>& cuts,
+    vector<unordered_set<BasicBlock*>>& availValueSets,
+    vector<unordered_set<BasicBlock*>>& pantiValueSets,
+    std::map<int, ExprCost>& costs,
+    BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry){
+    std::map<int, double> profit;
+    for(auto& cut : cuts){
+      ReducedFlowGraph RFG(findEssentialEdge(availValueSets[cut.first], pantiValueSets[cut.first]),
+        bpi, bfi, entry, costs[cut.first]);
+      Capacity saved = RFG.sinkWeight();
+      Capacity spent = RFG.weightOf(cut.second);
+      profit[cut.first] = saved > spent ? (double)(saved - spent) : 0;
+    }
+    return profit;
+  }
+
+  /// dropDependents - Under the joint placement a value number is cloned
+  /// with the copies of its operands, so it goes too when one of them was
+  /// dropped. Adds those value numbers to dropped.
+  void dropDependents(ValueTable& VN, unordered_map<int, vector<Value*>>& numberToValues,
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>>& cuts, std::set<int>& dropped){
+    bool changed = JointPlacement;
+    while(changed){
+      changed = false;
+      for(auto& cut : cuts){
+        if(dropped.count(cut.first))
+          continue;
+        for(int op : operandNumbers(VN, numberToValues[cut.first], cut.first))
+          if(dropped.count(op)){
+            dropped.insert(cut.first);
+            changed = true;
+            break;
+          }
+      }
+    }
+  }
+
+  /// dropInsertions - Remove the dropped value numbers, and the ones that
+  /// depend on them, from insertSets.
+  void dropInsertions(ValueTable& VN, unordered_map<int, vector<Value*>>& numberToValues,
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>>& cuts, std::set<int>& dropped,
+    unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>& insertSets){
+    dropDependents(VN, numberToValues, cuts, dropped);
+
+    for(auto& insertSet : insertSets){
+      auto& vns = insertSet.second;
+      vns.erase(std::remove_if(vns.begin(), vns.end(),
+        [&](int n){ return dropped.count(n) != 0; }), vns.end());
+    }
+  }
+
+  /// codeSize - TargetTransformInfo code size of one copy of the expressions
+  /// with one value number.
+  uint64_t codeSize(vector<Value*>& values, TargetTransformInfo& TTI){
+    for(Value* v : values){
+      Instruction* I = dyn_cast<Instruction>(v);
+      if(!I || isa<PHINode>(I))
+        continue;
+      InstructionCost size = TTI.getInstructionCost(I, TargetTransformInfo::TCK_CodeSize);
+      return size.isValid() ? std::max<int64_t>(1, *size.getValue()) : 1;
+    }
+    return 1;
+  }
+
+  /// growthBudget - Keep the copies that insertSets asks for within budget
+  /// size units. When they do not fit, value numbers are taken greedily by
+  /// profit per unit of size, where the profit is what the min-cut saves over
+  /// leaving the computations where they are. Under the joint placement a
+  /// value number is also dropped when an operand it is cloned with was.
+  /// Returns the size of the copies that are kept.
+  uint64_t growthBudget(ValueTable& VN, unordered_map<int, vector<Value*>>& numberToValues,
+    vector<unordered_set<BasicBlock*>>& availValueSets,
+    vector<unordered_set<BasicBlock*>>& pantiValueSets,
+    std::map<int, ExprCost>& costs, TargetTransformInfo& TTI,
+    BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, BasicBlock* entry,
+    unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>& insertSets,
+    uint64_t budget){
+
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cuts = cutsOf(insertSets);
+
+    std::map<int, uint64_t> size;
+    uint64_t total = 0;
+    for(auto& cut : cuts){
+      size[cut.first] = cut.second.size() * codeSize(numberToValues[cut.first], TTI);
+      total += size[cut.first];
+    }
+    if(total <= budget)
+      return total;
+
+    std::map<int, double> profit = insertionProfits(cuts, availValueSets,
+      pantiValueSets, costs, bpi, bfi, entry);
+    vector<int> ranked;
+    for(auto& cut : cuts)
+      ranked.push_back(cut.first);
+    std::stable_sort(ranked.begin(), ranked.end(), [&](int a, int b){
+      return profit[a] / size[a] > profit[b] / size[b];
+    });
+
+    // A drop can take value numbers that were already kept with it, so the
+    // size in use is recomputed after each one and what they freed goes to
+    // the next candidates
+    std::set<int> dropped;
+    vector<int> kept;
+    uint64_t used = 0;
+    for(int n : ranked){
+      if(dropped.count(n))
+        continue;
+      if(used + size[n] <= budget){
+        kept.push_back(n);
+        used += size[n];
+        continue;
+      }
+      dropped.insert(n);
+      dropDependents(VN, numberToValues, cuts, dropped);
+      used = 0;
+      for(int k : kept)
+        if(!dropped.count(k))
+          used += size[k];
+    }
+    dropInsertions(VN, numberToValues, cuts, dropped, insertSets);
+
+    errs() << "growth budget: kept " << used << " of " << total
+           << ", dropped " << dropped.size() << " value numbers\n";
+    return used;
+  }
+
+  /// pressureVeto - Reject the speculation of value numbers whose longer
+  /// live range would need more registers than their class has in a block
+  /// that runs at least as often as the entry. The value then stays
+  /// recomputed where it was, which is the rematerialized form. Pressure is
+  /// the largest number of simultaneously live values of a register class in
+  /// a block, and every accepted value number adds one to the blocks its cut
+  /// makes it live through. Value numbers claim registers in the order of
+  /// their profit.
+  void pressureVeto(Function& F, ValueTable& VN,
+    unordered_map<int, vector<Value*>>& numberToValues,
+    vector<unordered_set<BasicBlock*>>& availValueSets,
+    vector<unordered_set<BasicBlock*>>& pantiValueSets,
+    std::map<int, ExprCost>& costs, TargetTransformInfo& TTI,
+    BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi,
+    unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>& insertSets){
+
+    auto classOf = [&](Type* Ty){
+      return TTI.getRegisterClassForType(Ty->isVectorTy(), Ty);
+    };
+    auto inRegister = [](Value* V){
+      return (isa<Instruction>(V) || isa<Argument>(V)) && !V->getType()->isVoidTy() &&
+             !V->getType()->isTokenTy() && !V->getType()->isLabelTy();
+    };
+
+    // Live out sets by backward dataflow, PHI operands live out of their
+    // incoming block only
+    DenseMap<BasicBlock*, SmallPtrSet<Value*, 16>> liveIn, liveOut;
+    bool changed = true;
+    while(changed){
+      changed = false;
+      for(BasicBlock* BB : post_order(&F.getEntryBlock())){
+        SmallPtrSet<Value*, 16> out;
+        for(BasicBlock* S : successors(BB)){
+          for(Value* V : liveIn[S])
+            if(!isa<PHINode>(V) || cast<PHINode>(V)->getParent() != S)
+              out.insert(V);
+          for(PHINode& P : S->phis()){
+            Value* V = P.getIncomingValueForBlock(BB);
+            if(inRegister(V))
+              out.insert(V);
+          }
+        }
+        SmallPtrSet<Value*, 16> in = out;
+        for(Instruction& I : reverse(*BB)){
+          in.erase(&I);
+          if(isa<PHINode>(I)){
+            in.insert(&I);
+            continue;
+          }
+          for(Value* op : I.operands())
+            if(inRegister(op))
+              in.insert(op);
+        }
+        if(in.size() != liveIn[BB].size() || out.size() != liveOut[BB].size()){
+          liveIn[BB] = in;
+          liveOut[BB] = out;
+          changed = true;
+        }
+      }
+    }
+
+    DenseMap<BasicBlock*, std::map<unsigned, unsigned>> pressure;
+    for(BasicBlock& BB : F){
+      SmallPtrSet<Value*, 16> live = liveOut[&BB];
+      std::map<unsigned, unsigned>& peak = pressure[&BB];
+      auto measure = [&](){
+        std::map<unsigned, unsigned> count;
+        for(Value* V : live)
+          count[classOf(V->getType())]++;
+        for(auto& c : count)
+          peak[c.first] = std::max(peak[c.first], c.second);
+      };
+      measure();
+      for(Instruction& I : reverse(BB)){
+        if(isa<PHINode>(I))
+          break;
+        live.erase(&I);
+        for(Value* op : I.operands())
+          if(inRegister(op))
+            live.insert(op);
+        measure();
+      }
+    }
+
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cuts = cutsOf(insertSets);
+    std::map<int, double> profit = insertionProfits(cuts, availValueSets,
+      pantiValueSets, costs, bpi, bfi, &F.getEntryBlock());
+    vector<int> ranked;
+    for(auto& cut : cuts)
+      ranked.push_back(cut.first);
+    std::stable_sort(ranked.begin(), ranked.end(), [&](int a, int b){
+      return profit[a] > profit[b];
+    });
+
+    uint64_t entryFreq = bfi.getEntryFreq();
+    std::set<int> dropped;
+    for(int n : ranked){
+      Type* Ty = 0;
+      for(Value* v : numberToValues[n])
+        if(isa<Instruction>(v))
+          Ty = v->getType();
+      if(!Ty)
+        continue;
+      unsigned regClass = classOf(Ty);
+      unsigned registers = TTI.getNumberOfRegisters(regClass);
+
+      // The blocks the value is live through from its cut edges on
+      vector<pair<BasicBlock*, BasicBlock*>> edges =
+        findEssentialEdge(availValueSets[n], pantiValueSets[n]);
+      SmallPtrSet<BasicBlock*, 16> range;
+      SmallVector<BasicBlock*, 16> worklist;
+      for(auto edge : cuts[n])
+        worklist.push_back(edge.second);
+      while(!worklist.empty()){
+        BasicBlock* BB = worklist.pop_back_val();
+        if(!range.insert(BB).second)
+          continue;
+        for(auto edge : edges)
+          if(edge.first == BB)
+            worklist.push_back(edge.second);
+      }
+
+      bool fits = true;
+      for(BasicBlock* BB : range)
+        if(bfi.getBlockFreq(BB).getFrequency() >= entryFreq &&
+           pressure[BB][regClass] + 1 > registers){
+          errs() << "pressure: veto " << n << " in " << BB->getName() << "\n";
+          fits = false;
+          break;
+        }
+      if(!fits){
+        dropped.insert(n);
+        continue;
+      }
+      for(BasicBlock* BB : range)
+        pressure[BB][regClass]++;
+    }
+    dropInsertions(VN, numberToValues, cuts, dropped, insertSets);
+  }
+
+  /// likelyVectorized - Whether L has the shape the loop vectorizer takes:
+  /// innermost, with a preheader, a single latch and a single exiting block,
+  /// a backedge-taken count ScalarEvolution can compute, and no calls other
+  /// than intrinsics.
+  bool likelyVectorized(Loop* L, ScalarEvolution& SE){
+    if(!L->isInnermost() || !L->getLoopPreheader() || !L->getLoopLatch() ||
+       !L->getExitingBlock())
+      return false;
+    if(isa<SCEVCouldNotCompute>(SE.getBackedgeTakenCount(L)))
+      return false;
+    for(BasicBlock* BB : L->blocks())
+      for(Instruction& I : *BB)
+        if(isa<CallBase>(I) && !isa<IntrinsicInst>(I))
+          return false;
+    return true;
+  }
+
+  /// vectorizerFriendly - Drop the value numbers that would be inserted on an
+  /// edge inside a loop that is likely to be vectorized. Copies on such edges
+  /// become PHIs in the loop body, and once the induction update or the exit
+  /// compare goes through one the trip count is no longer countable. The
+  /// preheader edge is left alone, it is where invariants should go anyway.
+  void vectorizerFriendly(LoopInfo& LI, ScalarEvolution& SE, ValueTable& VN,
+    unordered_map<int, vector<Value*>>& numberToValues,
+    unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>& insertSets){
+    SmallPtrSet<Loop*, 8> vectorized;
+    for(Loop* L : LI.getLoopsInPreorder())
+      if(likelyVectorized(L, SE))
+        vectorized.insert(L);
+    if(vectorized.empty())
+      return;
+
+    std::map<int, vector<pair<BasicBlock*, BasicBlock*>>> cuts = cutsOf(insertSets);
+    std::set<int> dropped;
+    for(auto& cut : cuts)
+      for(auto edge : cut.second){
+        Loop* L = LI.getLoopFor(edge.second);
+        if(L && vectorized.count(L) && L->contains(edge.first)){
+          errs() << "vectorizer: keep " << cut.first << " out of "
+                 << L->getHeader()->getName() << "\n";
+          dropped.insert(cut.first);
+          break;
+        }
+      }
+    dropInsertions(VN, numberToValues, cuts, dropped, insertSets);
+  }
+
+  /// Rank - Loop depth first, then definition order. Constants rank lowest,
+  /// arguments right after them.
+  typedef pair<unsigned, unsigned> Rank;
+
+  /// isReassociable - Associative and commutative operators whose trees may be
+  /// reordered. Floating point needs -spgvnpre-reassociate-fp.
+  bool isReassociable(Value* V){
+    BinaryOperator* BO = dyn_cast<BinaryOperator>(V);
+    if(!BO || !BO->isAssociative() || !BO->isCommutative())
+      return false;
+    return !BO->getType()->isFPOrFPVectorTy() || ReassociateFP;
+  }
+
+  /// collectLeaves - In-order leaves of the single-use tree of opcode opc
+  /// rooted at I. Inner nodes are collected in inner.
+  void collectLeaves(Instruction* I, unsigned opc, SmallVectorImpl<Value*>& leaves,
+    SmallVectorImpl<Instruction*>& inner){
+    for(Value* op : I->operands()){
+      Instruction* opI = dyn_cast<Instruction>(op);
+      if(opI && opI->getOpcode() == opc && isReassociable(opI) && opI->hasOneUse()
+         && opI->getParent() == I->getParent()){
+        inner.push_back(opI);
+        collectLeaves(opI, opc, leaves, inner);
+      }
+      else{
+        leaves.push_back(op);
+      }
+    }
+  }
+
+  /// reassociate - Rebuild every tree of a reassociable operator as a left
+  /// linear chain with its leaves sorted by rank, so (a+i)+b with invariant
+  /// a and b becomes (a+b)+i. Returns true if anything changed.
+  bool reassociate(Function& F, LoopInfo& LI){
+    std::map<Value*, Rank> ranks;
+    unsigned order = 0;
+    for(Argument& A : F.args())
+      ranks[&A] = Rank(0, ++order);
+
+    ReversePostOrderTraversal<Function*> RPOT(&F);
+    for(BasicBlock* BB : RPOT)
+      for(Instruction& I : *BB)
+        ranks[&I] = Rank(LI.getLoopDepth(BB), ++order);
+
+    auto rankOf = [&](Value* V){
+      auto it = ranks.find(V);
+      return it == ranks.end() ? Rank(0, 0) : it->second;
+    };
+
+    bool changed = false;
+    for(BasicBlock* BB : RPOT){
+      SmallVector<Instruction*, 16> roots;
+      for(Instruction& I : *BB){
+        if(!isReassociable(&I))
+          continue;
+        // Only the top of a tree is rebuilt
+        if(I.hasOneUse()){
+          Instruction* user = cast<Instruction>(*I.user_begin());
+          if(user->getOpcode() == I.getOpcode() && isReassociable(user)
+             && user->getParent() == BB)
+            continue;
+        }
+        roots.push_back(&I);
+      }
+
+      for(Instruction* root : roots){
+        SmallVector<Value*, 8> leaves;
+        SmallVector<Instruction*, 8> inner;
+        collectLeaves(root, root->getOpcode(), leaves, inner);
+        if(leaves.size() < 3)
+          continue;
+
+        SmallVector<Value*, 8> sorted(leaves.begin(), leaves.end());
+        std::stable_sort(sorted.begin(), sorted.end(), [&](Value* a, Value* b){
+          return rankOf(a) < rankOf(b);
+        });
+        if(sorted == leaves)
+          continue;
+
+        // The rebuilt nodes get only the fast-math flags every node of the
+        // tree had
+        FastMathFlags FMF;
+        if(isa<FPMathOperator>(root)){
+          FMF = root->getFastMathFlags();
+          for(Instruction* I : inner)
+            FMF &= I->getFastMathFlags();
+        }
+
+        errs() << "reassociate " << *root << "\n";
+        IRBuilder<> builder(root);
+        Value* acc = sorted[0];
+        for(unsigned i=1; i<sorted.size(); i++){
+          acc = builder.CreateBinOp((Instruction::BinaryOps)root->getOpcode(), acc,
+            sorted[i], root->getName()+".reass");
+          if(Instruction* accI = dyn_cast<Instruction>(acc))
+            if(isa<FPMathOperator>(accI))
+              accI->setFastMathFlags(FMF);
+        }
+
+        root->replaceAllUsesWith(acc);
+        root->eraseFromParent();
+        for(Instruction* I : inner)
+          I->eraseFromParent();
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  /// strengthReduce - Replaces every multiplication whose value is an affine
+  /// recurrence {s,+,d} of its loop by a PHI that starts at s in the
+  /// preheader and adds d on each back edge. The multiplications of one
+  /// recurrence share the PHI. The increment runs on every iteration, also
+  /// where the multiplication sat behind a rarely taken branch, so a
+  /// recurrence is only reduced when its multiplications, weighted by
+  /// -spgvnpre-mul-cost and their block frequencies, cost more than the back
+  /// edges plus computing s and d in the preheader. Returns true if anything
+  /// changed.
+  bool strengthReduce(Function& F, LoopInfo& LI, ScalarEvolution& SE,
+    BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi){
+    bool changed = false;
+    SCEVExpander expander(SE, F.getParent()->getDataLayout(), "sr", false);
+    for(Loop* L : LI.getLoopsInPreorder()){
+      BasicBlock* preheader = L->getLoopPreheader();
+      if(!preheader)
+        continue;
+      BasicBlock* header = L->getHeader();
+
+      // The multiplications of the loop body, by recurrence
+      MapVector<const SCEVAddRecExpr*, SmallVector<Instruction*, 4>> recurrences;
+      for(BasicBlock* BB : L->blocks()){
+        if(LI.getLoopFor(BB) != L)
+          continue;
+        for(Instruction& I : *BB){
+          if(I.getOpcode() != Instruction::Mul && I.getOpcode() != Instruction::Shl)
+            continue;
+          if(!SE.isSCEVable(I.getType()))
+            continue;
+          const SCEVAddRecExpr* AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&I));
+          if(!AR || !AR->isAffine() || AR->getLoop() != L)
+            continue;
+          recurrences[AR].push_back(&I);
+        }
+      }
+
+      uint64_t preFreq = bfi.getBlockFreq(preheader).getFrequency();
+      uint64_t backFreq = 0;
+      for(BasicBlock* latch : predecessors(header))
+        if(L->contains(latch))
+          backFreq = SaturatingAdd(backFreq, bpi.getEdgeProbability(latch, header)
+                                     .scale(bfi.getBlockFreq(latch).getFrequency()));
+
+      for(auto& entry : recurrences){
+        const SCEVAddRecExpr* AR = entry.first;
+        const SCEV* start = AR->getStart();
+        const SCEV* step = AR->getStepRecurrence(SE);
+        Instruction* insertPt = preheader->getTerminator();
+        if(!isSafeToExpandAt(start, insertPt, SE) || !isSafeToExpandAt(step, insertPt, SE))
+          continue;
+
+        // A recurrence the loop already carries costs nothing
+        PHINode* phi = 0;
+        for(PHINode& P : header->phis())
+          if(SE.isSCEVable(P.getType()) && SE.getSCEV(&P) == AR)
+            phi = &P;
+        auto replaceBy = [&](PHINode* phi){
+          for(Instruction* I : entry.second){
+            SE.forgetValue(I);
+            I->replaceAllUsesWith(phi);
+            I->eraseFromParent();
+          }
+          changed = true;
+        };
+        if(phi){
+          errs() << "strength reduce " << *AR << " to " << phi->getName() << "\n";
+          replaceBy(phi);
+          continue;
+        }
+
+        uint64_t mulFreq = 0;
+        for(Instruction* I : entry.second)
+          mulFreq = SaturatingAdd(mulFreq, bfi.getBlockFreq(I->getParent()).getFrequency());
+        uint64_t reduced = SaturatingMultiplyAdd(preFreq, (uint64_t)2, backFreq);
+        errs() << "strength reduce " << *AR << ": " << SaturatingMultiply(mulFreq,
+          (uint64_t)MulCost) << " vs " << reduced << "\n";
+        if(SaturatingMultiply(mulFreq, (uint64_t)MulCost) <= reduced)
+          continue;
+
+        Type* Ty = entry.second[0]->getType();
+        Value* startV = expander.expandCodeFor(start, Ty, insertPt);
+        Value* stepV = expander.expandCodeFor(step, Ty, insertPt);
+        phi = PHINode::Create(Ty, pred_size(header), "sr", &header->front());
+        for(BasicBlock* P : predecessors(header)){
+          if(!L->contains(P)){
+            phi->addIncoming(startV, P);
+            continue;
+          }
+          Value* next = BinaryOperator::CreateAdd(phi, stepV, "sr.next", P->getTerminator());
+          phi->addIncoming(next, P);
+        }
+        replaceBy(phi);
+      }
+    }
+    return changed;
+  }
+
+  /// congruentPhis - Optimistic value numbering of the SSA graph, used to
+  /// find PHIs that always carry the same value. All PHIs of a block with the
+  /// same type start out in one class. Every round walks the function in
+  /// reverse postorder and splits a class whenever the incoming values or
+  /// operands of its members fall into different classes, until the loop
+  /// carried cycles reach a fixed point. The first round only numbers the
+  /// other instructions, so back edge values have a class before any PHI is
+  /// split by them. The key of a PHI includes its old
+  /// class, so classes only ever split and the iteration terminates. Returns
+  /// every PHI that is congruent to an earlier one, mapped to that PHI.
+  std::map<PHINode*, PHINode*> congruentPhis(Function& F){
+    ReversePostOrderTraversal<Function*> RPOT(&F);
+    DenseMap<Value*, Value*> leader;
+    auto cls = [&](Value* V){
+      auto it = leader.find(V);
+      return it == leader.end() ? V : it->second;
+    };
+
+    for(BasicBlock* BB : RPOT){
+      for(PHINode& P : BB->phis()){
+        for(PHINode& Q : BB->phis()){
+          if(Q.getType() == P.getType()){
+            leader[&P] = &Q;
+            break;
+          }
+        }
+      }
+    }
+
+    bool changed = true;
+    bool firstRound = true;
+    while(changed){
+      changed = firstRound;
+      std::map<vector<uintptr_t>, Value*> table;
+      for(BasicBlock* BB : RPOT){
+        for(Instruction& I : *BB){
+          vector<uintptr_t> key;
+          if(isa<PHINode>(&I) && firstRound){
+            continue;
+          }
+          else if(PHINode* P = dyn_cast<PHINode>(&I)){
+            key.push_back(0);
+            key.push_back((uintptr_t)BB);
+            key.push_back((uintptr_t)cls(P));
+            for(BasicBlock* pred : predecessors(BB))
+              key.push_back((uintptr_t)cls(P->getIncomingValueForBlock(pred)));
+          }
+          else if(isa<BinaryOperator>(I) || isa<CmpInst>(I) || isa<CastInst>(I) ||
+                  isa<SelectInst>(I) || isa<GetElementPtrInst>(I) || isa<UnaryOperator>(I)){
+            key.push_back(1);
+            key.push_back(I.getOpcode());
+            key.push_back((uintptr_t)I.getType());
+            if(CmpInst* C = dyn_cast<CmpInst>(&I))
+              key.push_back(C->getPredicate());
+            if(GetElementPtrInst* G = dyn_cast<GetElementPtrInst>(&I))
+              key.push_back((uintptr_t)G->getSourceElementType());
+            for(Value* op : I.operands())
+              key.push_back((uintptr_t)cls(op));
+          }
+          else{
+            continue;
+          }
+
+          Value* newLeader = table.insert(std::make_pair(key, &I)).first->second;
+          if(cls(&I) != newLeader){
+            leader[&I] = newLeader;
+            changed = true;
+          }
+        }
+      }
+      firstRound = false;
+    }
+
+    std::map<PHINode*, PHINode*> result;
+    for(BasicBlock& BB : F)
+      for(PHINode& P : BB.phis())
+        if(cls(&P) != &P)
+          result[&P] = cast<PHINode>(cls(&P));
+    return result;
+  }
+
+  /// opOfPhi - If every incoming value of Q is the same binary operator or
+  /// cast applied to the matching incoming value of another PHI R of the same
+  /// block, with an operand that is the same on every path, returns that
+  /// operation applied to R. The result is not inserted into the function.
+  Instruction* opOfPhi(PHINode* Q, ValueTable& VN, DominatorTree& DT){
+    BasicBlock* BB = Q->getParent();
+    Instruction* first = dyn_cast<Instruction>(Q->getIncomingValue(0));
+    if(!first || !(isa<BinaryOperator>(first) || isa<CastInst>(first)))
+      return 0;
+
+    for(unsigned i=1; i<Q->getNumIncomingValues(); i++){
+      Instruction* in = dyn_cast<Instruction>(Q->getIncomingValue(i));
+      if(!in || !in->isSameOperationAs(first))
+        return 0;
+    }
+
+    // The operand that varies with the path is position k, every other
+    // operand has to be one value that is available at the top of BB
+    for(unsigned k=0; k<first->getNumOperands(); k++){
+      bool invariant = true;
+      for(unsigned j=0; j<first->getNumOperands() && invariant; j++){
+        if(j == k)
+          continue;
+        Value* common = first->getOperand(j);
+        Instruction* commonI = dyn_cast<Instruction>(common);
+        if(commonI && !DT.properlyDominates(commonI->getParent(), BB))
+          invariant = false;
+        for(unsigned i=1; i<Q->getNumIncomingValues() && invariant; i++)
+          if(cast<Instruction>(Q->getIncomingValue(i))->getOperand(j) != common)
+            invariant = false;
+      }
+      if(!invariant)
+        continue;
+
+      for(PHINode& R : BB->phis()){
+        if(&R == Q || R.getType() != first->getOperand(k)->getType())
+          continue;
+        bool matches = true;
+        for(unsigned i=0; i<Q->getNumIncomingValues() && matches; i++){
+          Value* x = cast<Instruction>(Q->getIncomingValue(i))->getOperand(k);
+          Value* r = R.getIncomingValueForBlock(Q->getIncomingBlock(i));
+          matches = x == r || (VN.exists(x) && VN.exists(r) && VN.lookup(x) == VN.lookup(r));
+        }
+        if(matches){
+          Instruction* op = first->clone();
+          op->setOperand(k, &R);
+          return op;
+        }
+      }
+    }
+    return 0;
+  }
+
+  /// edgeFacts - Value numbers known to hold a constant on the edge of a
+  /// branch where its condition C is Taken: C itself, the compare with the
+  /// inverse predicate, the operands of a conjunction that is true or a
+  /// disjunction that is false, and x for x == c.
+  vector<pair<uint32_t, Constant*>> edgeFacts(Value* C, bool Taken, ValueTable& VN){
+    using namespace PatternMatch;
+    vector<pair<uint32_t, Constant*>> facts;
+    vector<pair<Value*, bool>> worklist;
+    worklist.push_back(std::make_pair(C, Taken));
+    while(!worklist.empty()){
+      Value* cond = worklist.back().first;
+      bool value = worklist.back().second;
+      worklist.pop_back();
+      if(!VN.exists(cond) || isa<Constant>(cond))
+        continue;
+      facts.push_back(std::make_pair(VN.lookup(cond),
+                                     ConstantInt::getBool(cond->getType(), value)));
+
+      Value *A, *B;
+      if((value && match(cond, m_LogicalAnd(m_Value(A), m_Value(B)))) ||
+         (!value && match(cond, m_LogicalOr(m_Value(A), m_Value(B))))){
+        worklist.push_back(std::make_pair(A, value));
+        worklist.push_back(std::make_pair(B, value));
+        continue;
+      }
+
+      ICmpInst* cmp = dyn_cast<ICmpInst>(cond);
+      if(!cmp)
+        continue;
+      ICmpInst* inverse = new ICmpInst(cmp->getInversePredicate(),
+        cmp->getOperand(0), cmp->getOperand(1), cmp->getName()+".inv");
+      facts.push_back(std::make_pair(VN.lookup_or_add(inverse),
+                                     ConstantInt::getBool(cond->getType(), !value)));
+      VN.erase(inverse);
+      inverse->deleteValue();
+
+      if(cmp->getPredicate() == (value ? ICmpInst::ICMP_EQ : ICmpInst::ICMP_NE)){
+        Value* x = cmp->getOperand(0);
+        Constant* c = dyn_cast<Constant>(cmp->getOperand(1));
+        if(!c){
+          x = cmp->getOperand(1);
+          c = dyn_cast<Constant>(cmp->getOperand(0));
+        }
+        if(c && !isa<Constant>(x) && VN.exists(x))
+          facts.push_back(std::make_pair(VN.lookup(x), c));
+      }
+    }
+    return facts;
+  }
+
+  /// propagatePredicates - Replaces every use that a branch edge dominates of
+  /// a value whose number the branch condition decides by that constant, and
+  /// folds the branches whose condition becomes constant.
+  bool propagatePredicates(Function& F, ValueTable& VN, DominatorTree& DT){
+    bool changed = false;
+    vector<BranchInst*> branches;
+    for(BasicBlock& BB : F)
+      if(BranchInst* BI = dyn_cast<BranchInst>(BB.getTerminator()))
+        if(BI->isConditional() && BI->getSuccessor(0) != BI->getSuccessor(1))
+          branches.push_back(BI);
+
+    for(BranchInst* BI : branches){
+      for(unsigned s=0; s<2; s++){
+        BasicBlockEdge edge(BI->getParent(), BI->getSuccessor(s));
+        vector<pair<uint32_t, Constant*>> facts = edgeFacts(BI->getCondition(), s == 0, VN);
+        if(facts.empty())
+          continue;
+
+        // Only uses in the blocks the edge dominates and in the PHIs on the
+        // border of that region can be dominated by the edge
+        BasicBlock* end = BI->getSuccessor(s);
+        SmallVector<BasicBlock*, 16> region;
+        if(DT.dominates(edge, end))
+          for(DomTreeNode* N : depth_first(DT.getNode(end)))
+            region.push_back(N->getBlock());
+        SmallVector<Instruction*, 32> users;
+        SmallPtrSet<BasicBlock*, 16> border;
+        border.insert(end);
+        for(BasicBlock* BB : region){
+          for(Instruction& I : *BB)
+            if(!isa<PHINode>(I))
+              users.push_back(&I);
+          for(BasicBlock* S : successors(BB))
+            border.insert(S);
+        }
+        for(BasicBlock* BB : border)
+          for(PHINode& P : BB->phis())
+            users.push_back(&P);
+
+        for(Instruction* user : users){
+          for(Use& U : user->operands()){
+            Value* V = U.get();
+            if(isa<Constant>(V) || !VN.exists(V))
+              continue;
+            uint32_t num = VN.lookup(V);
+            for(auto& fact : facts){
+              if(fact.first != num || fact.second->getType() != V->getType())
+                continue;
+              if(DT.dominates(edge, U)){
+                errs() << "known " << *fact.second << " for " << *V << "\n";
+                U.set(fact.second);
+                changed = true;
+              }
+              break;
+            }
+          }
+        }
+      }
+    }
+
+    for(BasicBlock& BB : F)
+      changed |= ConstantFoldTerminator(&BB, true);
+    if(changed)
+      removeUnreachableBlocks(F);
+    return changed;
+  }
+
+}
+
+
+
+bool SPGVNPRE::runOnFunction(Function &F) {
+  // Compensation code that -spgvnco outlined out of an earlier run is
+  // cold, there is nothing hot enough in it to speculate for
+  if(F.hasFnAttribute("spgvnpre-outlined"))
+    return false;
+  errs() << F.getName() << " begin\n";
+  BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(); 
+  BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  // Clean out global sets from any previous functions
+  VN.clear();
+  VN.setMemorySSA(&getAnalysis<MemorySSAWrapperPass>().getMSSA());
+  VN.setDataLayout(&F.getParent()->getDataLayout());
+  createdExpressions.clear();
+  availableOut.clear();
+  anticipatedIn.clear();
+  generatedPhis.clear();
+ 
+  bool changed_function = false;
+  
+  // Phase 0: Reassociate so equal sums number equal
+  if(Reassociate)
+    changed_function |= reassociate(F, getAnalysis<LoopInfoWrapperPass>().getLoopInfo());
+
+  // Multiplications of induction variables become incremented PHIs, which
+  // PRE then treats like any other PHI
+  if(StrengthReduce)
+    changed_function |= strengthReduce(F, getAnalysis<LoopInfoWrapperPass>().getLoopInfo(),
+      getAnalysis<ScalarEvolutionWrapperPass>().getSE(), bpi, bfi);
+  
+  // Congruent PHIs share the number of the first PHI of their class, and
+  // through it every expression computed from them
+  if(OptimisticPhis){
+    for(auto& congruent : congruentPhis(F)){
+      errs() << "congruent phi " << congruent.first->getName() << " = " 
+        << congruent.second->getName() << "\n";
+      VN.add(congruent.first, VN.lookup_or_add(congruent.second));
+    }
+  }
+  
+  // A PHI of operations takes the number of the operation on the PHI of
+  // operands, so later copies of that operation are redundant with it
+  vector<pair<PHINode*, uint32_t>> phisOfOps;
+  if(PhiOfOps){
+    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    ReversePostOrderTraversal<Function*> RPOT(&F);
+    for(BasicBlock* BB : RPOT){
+      for(PHINode& Q : BB->phis()){
+        Instruction* op = opOfPhi(&Q, VN, DT);
+        if(!op)
+          continue;
+        uint32_t num = VN.lookup_or_add(op);
+        VN.erase(op);
+        op->deleteValue();
+        VN.add(&Q, num);
+        phisOfOps.push_back(std::make_pair(&Q, num));
+        errs() << "phi of ops " << Q << " numbered " << num << "\n";
+      }
+    }
+  }
+  
+  // Phase 1: BuildSets
+  // This phase calculates the AVAIL_OUT and ANTIC_IN sets
+  // ScalarEvolution only helps numbering, it goes stale once edges are split
+  VN.setScalarEvolution(&getAnalysis<ScalarEvolutionWrapperPass>().getSE());
+  buildsets(F);
+  VN.setScalarEvolution(0);
+
+  errs() << "avaiableOut for each Basic Block \n";
+  for(auto it = availableOut.begin(); it!=availableOut.end(); ++it){
+    errs() << "Block: " << it->first->getName() << "\n";
+    it->second.print(VN);
+  }
+
+  errs() << "anticipateIn for each Basic Block \n";
+  for(auto it = anticipatedIn.begin(); it!=anticipatedIn.end(); ++it){
+    errs() << "Block: " << it->first->getName() << "\n";
+    it->second.print(VN);
   }
 
 
@@ -2064,18 +4144,72 @@ bool SPGVNPRE::runOnFunction(Function &F) {
 
   unordered_map<pair<BasicBlock*, BasicBlock*>, vector<int>, pairHash>insertSets; 
 
+  unordered_map<int, vector<Value*>> numberToValues = VN.valueWithNumber();
+
+  // A simplified expression only shares the number of its simplified value,
+  // so it never stands for that number in placement or insertion
+  for(auto& entry : numberToValues){
+    vector<Value*>& values = entry.second;
+    values.erase(std::remove_if(values.begin(), values.end(),
+      [&](Value* v){ return VN.simplified().count(v) != 0; }), values.end());
+  }
+
+  // Blocks entered by an edge that cannot be split, landing pads above all,
+  // keep their own computations and are never part of a cut
+  for(BasicBlock& BB : F)
+    if(unsplittableEntry(&BB))
+      for(auto& panti : pantiValueSets)
+        panti.erase(&BB);
+
+  // Value numbers that could trap are never placed speculatively. They may
+  // still be inserted where they are executed on every path anyway.
+  PostDominatorTree &PDT = getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
   for(int i=0; i<VN.size(); i++){
-    vector<pair<BasicBlock*, BasicBlock*>> essentialEdges 
-      = findEssentialEdge(availValueSets[i], pantiValueSets[i]);
-    
-    errs() << "valunumber: " << i << "\n";
-    
-    ReducedFlowGraph RFG(essentialEdges,bpi, bfi, &F.getEntryBlock());
-    vector<pair<BasicBlock*, BasicBlock*>> optimalInsertSet = RFG.minCut();
-    for(auto edge : optimalInsertSet){
-      insertSets[edge].push_back(i);
+    if(!speculationSafe(numberToValues[i])){
+      errs() << "unsafe to speculate: " << i << "\n";
+      restrictToDownSafe(pantiValueSets[i], numberToValues[i], PDT);
     }
+  }
 
+  // Expressions that fold to a constant or an argument are replaced by it
+  // below and need no placement
+  for(int i=0; i<VN.size(); i++){
+    for(Value* v : numberToValues[i]){
+      if(isa<Constant>(v) || isa<Argument>(v)){
+        pantiValueSets[i].clear();
+        break;
+      }
+    }
+  }
+
+  std::map<int, ExprCost> costs;
+  TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+  bool optSize = F.hasOptSize() || SizeMode;
+  if(TTICost || optSize){
+    for(int i=0; i<VN.size(); i++){
+      costs[i] = expressionCost(numberToValues[i], TTI, optSize);
+      errs() << "cost of " << i << ": " << costs[i].dyn << " " << costs[i].stat << "\n";
+    }
+  }
+
+  if(JointPlacement){
+    jointPlacement(VN, numberToValues, availValueSets, pantiValueSets, 
+      costs, bpi, bfi, &F.getEntryBlock(), insertSets);
+  }
+  else{
+    for(int i=0; i<VN.size(); i++){
+      vector<pair<BasicBlock*, BasicBlock*>> essentialEdges 
+        = findEssentialEdge(availValueSets[i], pantiValueSets[i]);
+      
+      errs() << "valunumber: " << i << "\n";
+      
+      ReducedFlowGraph RFG(essentialEdges,bpi, bfi, &F.getEntryBlock(), costs[i]);
+      vector<pair<BasicBlock*, BasicBlock*>> optimalInsertSet = RFG.minCut();
+      for(auto edge : optimalInsertSet){
+        insertSets[edge].push_back(i);
+      }
+
+    }
   }
 
 
@@ -2086,17 +4220,47 @@ bool SPGVNPRE::runOnFunction(Function &F) {
   // // fully redundant
   // changed_function |= insertion(F);
   
+  if(VectorizerFriendly)
+    vectorizerFriendly(getAnalysis<LoopInfoWrapperPass>().getLoopInfo(),
+      getAnalysis<ScalarEvolutionWrapperPass>().getSE(), VN, numberToValues, insertSets);
+
+  if(PressureVeto)
+    pressureVeto(F, VN, numberToValues, availValueSets, pantiValueSets, costs, TTI,
+      bpi, bfi, insertSets);
+
+  // Growth budgets of the function and of what is left of the module's
+  if(GrowthBudget || ModuleGrowthBudget){
+    uint64_t budget = std::numeric_limits<uint64_t>::max();
+    if(GrowthBudget)
+      budget = GrowthBudget;
+    if(ModuleGrowthBudget)
+      budget = std::min<uint64_t>(budget, ModuleGrowthBudget > moduleGrowth ?
+                                          ModuleGrowthBudget - moduleGrowth : 0);
+    moduleGrowth += growthBudget(VN, numberToValues, availValueSets, pantiValueSets,
+      costs, TTI, bpi, bfi, &F.getEntryBlock(), insertSets, budget);
+  }
+
   unordered_map<int, vector<Instruction*>> newValueSets; 
+  // Compensation blocks on rarely taken edges
+  SmallPtrSet<BasicBlock*, 8> coldBlocks;
 
-  unordered_map<int, vector<Value*>> numberToValues = VN.valueWithNumber();
   for(auto insertSet : insertSets){
     if(insertSet.second.empty()) continue;
 
+    bool cold = bpi.getEdgeProbability(insertSet.first.first, insertSet.first.second)
+                <= BranchProbability(ColdPercent, 100);
+    if(cold)
+      setProfileWeights(insertSet.first.first->getTerminator(), bpi);
     BasicBlock * newBB = SplitEdge(insertSet.first.first, insertSet.first.second);
+    if(cold)
+      coldBlocks.insert(newBB);
     auto vns = availableOut[insertSet.first.first];
     errs() << "insert into " << newBB->getName()<<"\n";
     errs() << "available\n";
     vns.print();
+
+    // Values cloned into newBB so far, used as operands by the joint placement
+    unordered_map<int, Instruction*> insertedHere;
     
     for(int n : insertSet.second){
       errs() << n << " prepared\n";
@@ -2106,7 +4270,9 @@ bool SPGVNPRE::runOnFunction(Function &F) {
           errs() << "try " << *v << "\n";
           Instruction* I = dyn_cast<Instruction>(v);
           bool valid = true;
-          for(int i=0; i<I->getNumOperands(); i++){
+          // The joint placement already guarantees that every operand is
+          // available by value number, renaming fixes the rest
+          for(int i=0; i<I->getNumOperands() && !JointPlacement; i++){
             Value* operand = I->getOperand(i);
             if(isa<Instruction>(operand) && vns.find(operand) == vns.end()){
               valid = false;
@@ -2122,6 +4288,23 @@ bool SPGVNPRE::runOnFunction(Function &F) {
             newBB->getInstList().insert(--lastinsert, I2);
             newValueSets[n].push_back(I2);
 
+            if(JointPlacement){
+              for(unsigned i=0; i<I2->getNumOperands(); i++){
+                Value* operand = I2->getOperand(i);
+                if(!isa<Instruction>(operand) || !VN.exists(operand))
+                  continue;
+                uint32_t opvn = VN.lookup(operand);
+                if(insertedHere.count(opvn))
+                  I2->setOperand(i, insertedHere[opvn]);
+                else if(Value* leader = find_leader(vns, opvn))
+                  I2->setOperand(i, leader);
+              }
+              insertedHere[n] = I2;
+            }
+
+            if(GuardTraps && !isSafeToSpeculativelyExecute(I2) && isGuardable(I2))
+              guardDivision(I2);
+
             break;
           }
         }
@@ -2198,6 +4381,51 @@ bool SPGVNPRE::runOnFunction(Function &F) {
   }
 
 
+  // A PHI is only valid when every predecessor is reached by a new value of
+  // its value number. Drop the others (and the PHIs that relied on them)
+  // before renaming so that no use is ever rewritten to them.
+  bool pruned = true;
+  while(pruned){
+    pruned = false;
+    for(auto& it : newValueSets){
+      vector<Instruction*>& newDefined = it.second;
+      unordered_set<BasicBlock*> defBlocks;
+      for(Instruction* I : newDefined){
+        defBlocks.insert(I->getParent());
+      }
+
+      for(auto dit = newDefined.begin(); dit != newDefined.end(); ){
+        PHINode* phi = dyn_cast<PHINode>(*dit);
+        bool complete = true;
+        if(phi){
+          for(BasicBlock* pred : predecessors(phi->getParent())){
+            bool reached = false;
+            for(DomTreeNode* node = DT.getNode(pred); node; node = node->getIDom()){
+              if(defBlocks.count(node->getBlock())){
+                reached = true;
+                break;
+              }
+            }
+            if(!reached){
+              complete = false;
+              break;
+            }
+          }
+        }
+
+        if(!complete){
+          errs() << "drop incomplete " << *phi << "\n";
+          phi->eraseFromParent();
+          dit = newDefined.erase(dit);
+          pruned = true;
+        }
+        else{
+          ++dit;
+        }
+      }
+    }
+  }
+
   unordered_map<Instruction*, int> revNewValue;
 
   for(auto it : newValueSets){
@@ -2216,6 +4444,40 @@ bool SPGVNPRE::runOnFunction(Function &F) {
   unordered_map<int, stack<Value*>> VRStack;
   rename(VRStack, DT.getRootNode(), newValueSets, revNewValue, VN);
 
+  // Expressions that simplified to a value available at their position
+  for(auto& simplified : VN.simplified()){
+    Instruction* I = dyn_cast<Instruction>(simplified.first);
+    if(!I || !I->getParent() || I->use_empty())
+      continue;
+    Instruction* S = dyn_cast<Instruction>(simplified.second);
+    if(!S || DT.dominates(S, I)){
+      errs() << "simplify " << *I << " to " << *simplified.second << "\n";
+      I->replaceAllUsesWith(simplified.second);
+      changed_function = true;
+    }
+  }
+
+  // Operations on a PHI that a PHI of operations already computes
+  for(auto& phiOfOps : phisOfOps){
+    for(Value* v : numberToValues[phiOfOps.second]){
+      Instruction* I = dyn_cast<Instruction>(v);
+      if(!I || isa<PHINode>(I) || !I->getParent() || I->use_empty())
+        continue;
+      if(DT.dominates(phiOfOps.first, I)){
+        // Numbering ignores nsw, nuw, exact and fast-math flags. The PHI
+        // must not be more poisonous than I, so the operations it merges
+        // keep only the flags I has too.
+        for(Value* in : phiOfOps.first->incoming_values())
+          if(Instruction* inI = dyn_cast<Instruction>(in))
+            if(inI->getOpcode() == I->getOpcode())
+              inI->andIRFlags(I);
+        errs() << "replace " << *I << " by " << *phiOfOps.first << "\n";
+        I->replaceAllUsesWith(phiOfOps.first);
+        changed_function = true;
+      }
+    }
+  }
+
 
   for (Function::iterator bb = F.begin(); bb!=F.end(); ++bb){ // iterate BBs 
     errs() << *bb << "\n";
@@ -2250,6 +4512,33 @@ bool SPGVNPRE::runOnFunction(Function &F) {
 
 
   
+  // Branches and compares that dominating branch conditions decide. This
+  // changes the CFG, so it runs once the sets are no longer needed.
+  if(PredicateVN){
+    for(auto& it : newValueSets)
+      for(Instruction* I : it.second)
+        if(!isa<PHINode>(I) && !VN.exists(I))
+          VN.add(I, it.first);
+    DominatorTree predDT(F);
+    changed_function |= propagatePredicates(F, VN, predDT);
+  }
+
+  // Cold compensation code leaves the hot blocks contiguous. Blocks that
+  // predicate propagation removed are no longer in F, so F is walked rather
+  // than coldBlocks.
+  SmallVector<BasicBlock*, 8> cold;
+  for(BasicBlock& BB : F)
+    if(coldBlocks.count(&BB))
+      cold.push_back(&BB);
+  for(BasicBlock* BB : cold){
+    errs() << "cold " << BB->getName() << "\n";
+    if(OutlineCold)
+      BB->getTerminator()->setMetadata("spgvnpre.cold",
+                                       MDNode::get(F.getContext(), {}));
+    if(BB != &F.back())
+      BB->moveAfter(&F.back());
+  }
+
   // Phase 5: Cleanup
   // This phase cleans up values that were created solely
   // as leaders for expressions
@@ -2264,3 +4553,923 @@ char SPGVNPRE::ID = 0;
   
 static RegisterPass<SPGVNPRE> X("spgvnpre",
                       "SPeculation-based Global Value Numbering/Partial Redundancy Elimination");
+
+
+namespace {
+  /// SPGVNPDE - Speculative partial dead code elimination, the dual of
+  /// SPGVNPRE. A computation whose value is dead on some paths leaving its
+  /// block is sunk onto the edges of a minimum cut between the block and its
+  /// uses, weighted by the profile, so the paths where it is dead no longer
+  /// pay for it.
+  class SPGVNPDE : public FunctionPass {
+    bool runOnFunction(Function &F);
+  public:
+    static char ID; // Pass identification, replacement for typeid
+    SPGVNPDE() : FunctionPass(ID) {}
+  private:
+    bool sinkable(Instruction* I);
+    bool worthSinking(BasicBlock* D, vector<pair<BasicBlock*, BasicBlock*>>& cut,
+                      BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi);
+    bool placeable(vector<pair<BasicBlock*, BasicBlock*>>& cut);
+    BasicBlock* placeOnEdge(Instruction* copy, pair<BasicBlock*, BasicBlock*> edge);
+    bool sink(Instruction* I, BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi,
+              TargetTransformInfo& TTI);
+    StoreInst* lastStoreTo(BasicBlock* P, Value* ptr, AAResults& AA);
+    bool mergeStores(BasicBlock* J, AAResults& AA, DominatorTree& DT);
+    bool sinkStore(StoreInst* SI, AAResults& AA, DominatorTree& DT,
+                   BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi,
+                   TargetTransformInfo& TTI);
+
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+      AU.addRequired<TargetTransformInfoWrapperPass>();
+      AU.addRequired<TargetLibraryInfoWrapperPass>();
+      AU.addRequired<AssumptionCacheTracker>();
+    }
+  };
+}
+
+/// sinkable - Only computations that cannot trap and do not touch memory
+/// move, so executing them later on fewer paths is never observable.
+bool SPGVNPDE::sinkable(Instruction* I) {
+  if (isa<PHINode>(I) || I->isTerminator() || I->isEHPad() ||
+      isa<AllocaInst>(I) || isa<CallBase>(I) || I->use_empty() ||
+      I->getType()->isTokenTy())
+    return false;
+  return !I->mayReadOrWriteMemory() && isSafeToSpeculativelyExecute(I);
+}
+
+/// worthSinking - A cut pays off when something is dead below D and its
+/// edges execute less often than D.
+bool SPGVNPDE::worthSinking(BasicBlock* D, vector<pair<BasicBlock*, BasicBlock*>>& cut,
+                            BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi) {
+  // Nothing is dead when the cut is every edge leaving D
+  bool belowD = false;
+  for (auto edge : cut)
+    belowD |= edge.first != D;
+  if (!belowD && cut.size() == succ_size(D))
+    return false;
+
+  uint64_t cutFreq = 0;
+  for (auto edge : cut)
+    cutFreq = SaturatingAdd(cutFreq, bpi.getEdgeProbability(edge.first, edge.second)
+                                       .scale(bfi.getBlockFreq(edge.first).getFrequency()));
+  return cutFreq < bfi.getBlockFreq(D).getFrequency();
+}
+
+/// atTopOf - Whether a copy for the edge can go to the top of its target:
+/// the edge is the only way in, there are no PHIs to get past, and the
+/// block has room for more than its EH pad.
+static bool atTopOf(pair<BasicBlock*, BasicBlock*> edge) {
+  BasicBlock* S = edge.second;
+  return S != edge.first && S->getSinglePredecessor() == edge.first &&
+         !isa<PHINode>(S->front()) && S->getFirstInsertionPt() != S->end();
+}
+
+/// placeable - Whether placeOnEdge can put a copy on every edge of the cut.
+/// The other edges would have to be split, which is impossible for the
+/// unwind edges of shared landing pads and the edges of indirectbr and
+/// callbr.
+bool SPGVNPDE::placeable(vector<pair<BasicBlock*, BasicBlock*>>& cut) {
+  for (auto edge : cut)
+    if (!atTopOf(edge) && unsplittableEntry(edge.second))
+      return false;
+  return true;
+}
+
+/// placeOnEdge - Inserts copy where it executes exactly when the edge is
+/// taken and returns its block. An edge into a block without PHIs that only
+/// it enters needs no new block, the copy goes to the top of the block.
+/// The edge has to be placeable.
+BasicBlock* SPGVNPDE::placeOnEdge(Instruction* copy, pair<BasicBlock*, BasicBlock*> edge) {
+  errs() << " " << edge.first->getName() << "-" << edge.second->getName();
+  BasicBlock* S = edge.second;
+  if (atTopOf(edge)) {
+    copy->insertBefore(&*S->getFirstInsertionPt());
+    return S;
+  }
+  BasicBlock* newBB = SplitEdge(edge.first, S);
+  assert(newBB && "Cut edge cannot be split?");
+  copy->insertBefore(newBB->getTerminator());
+  return newBB;
+}
+
+/// sink - Moves I from its block onto the cut edges of its live range when
+/// those edges execute less often than the block.
+bool SPGVNPDE::sink(Instruction* I, BranchProbabilityInfo& bpi,
+                    BlockFrequencyInfo& bfi, TargetTransformInfo& TTI) {
+  BasicBlock* D = I->getParent();
+  Function& F = *D->getParent();
+
+  // Blocks that use I, at their end for PHI operands
+  SmallPtrSet<BasicBlock*, 8> useBlocks;
+  for (Use& U : I->uses()) {
+    Instruction* user = cast<Instruction>(U.getUser());
+    BasicBlock* UB = user->getParent();
+    if (PHINode* P = dyn_cast<PHINode>(user))
+      UB = P->getIncomingBlock(U);
+    if (UB == D)
+      return false;
+    useBlocks.insert(UB);
+  }
+
+  // Blocks where I is live on entry
+  SmallPtrSet<BasicBlock*, 16> liveIn;
+  SmallVector<BasicBlock*, 16> worklist(useBlocks.begin(), useBlocks.end());
+  while (!worklist.empty()) {
+    BasicBlock* B = worklist.pop_back_val();
+    if (B == D || !liveIn.insert(B).second)
+      continue;
+    for (BasicBlock* P : predecessors(B))
+      worklist.push_back(P);
+  }
+
+  // The live range as seen from D. A use ends a path, since the copy that
+  // reaches it also reaches everything after it.
+  vector<pair<BasicBlock*, BasicBlock*>> liveEdges;
+  SmallPtrSet<BasicBlock*, 16> reached;
+  reached.insert(D);
+  worklist.push_back(D);
+  while (!worklist.empty()) {
+    BasicBlock* B = worklist.pop_back_val();
+    if (useBlocks.count(B))
+      continue;
+    SmallPtrSet<BasicBlock*, 4> seen;
+    for (BasicBlock* S : successors(B)) {
+      if (!liveIn.count(S) || !seen.insert(S).second)
+        continue;
+      liveEdges.push_back(pair<BasicBlock*, BasicBlock*>(B, S));
+      if (reached.insert(S).second)
+        worklist.push_back(S);
+    }
+  }
+  if (liveEdges.empty())
+    return false;
+
+  ExprCost cost;
+  if (TTICost) {
+    vector<Value*> values(1, I);
+    cost = expressionCost(values, TTI, F.hasOptSize());
+  }
+  ReducedFlowGraph RFG(liveEdges, bpi, bfi, &F.getEntryBlock(), cost);
+  vector<pair<BasicBlock*, BasicBlock*>> cut = RFG.minCut();
+  if (cut.empty())
+    return false;
+
+  if (!worthSinking(D, cut, bpi, bfi) || !placeable(cut))
+    return false;
+
+  errs() << "sink " << *I << " from " << D->getName() << " to";
+  SSAUpdater SSA;
+  SSA.Initialize(I->getType(), I->getName());
+  DenseMap<BasicBlock*, Instruction*> copyAtTop;
+  for (auto edge : cut) {
+    Instruction* copy = I->clone();
+    copy->setName(I->getName()+".sink");
+    BasicBlock* B = placeOnEdge(copy, edge);
+    if (B == edge.second)
+      copyAtTop[B] = copy;
+    SSA.AddAvailableValue(B, copy);
+  }
+  errs() << "\n";
+
+  SmallVector<Use*, 8> uses;
+  for (Use& U : I->uses())
+    uses.push_back(&U);
+  for (Use* U : uses) {
+    Instruction* user = cast<Instruction>(U->getUser());
+    if (!isa<PHINode>(user) && copyAtTop.count(user->getParent()))
+      U->set(copyAtTop[user->getParent()]);
+    else
+      SSA.RewriteUse(*U);
+  }
+  I->eraseFromParent();
+  return true;
+}
+
+/// lastStoreTo - Returns the last store to ptr in P, provided nothing after
+/// it in P touches the stored location.
+StoreInst* SPGVNPDE::lastStoreTo(BasicBlock* P, Value* ptr, AAResults& AA) {
+  for (auto it = P->rbegin(); it != P->rend(); ++it) {
+    StoreInst* SI = dyn_cast<StoreInst>(&*it);
+    if (!SI || !SI->isSimple() || SI->getPointerOperand() != ptr)
+      continue;
+    MemoryLocation Loc = MemoryLocation::get(SI);
+    for (auto after = std::next(SI->getIterator()); after != P->end(); ++after)
+      if (after->mayThrow() || isModOrRefSet(AA.getModRefInfo(&*after, Loc)))
+        return 0;
+    return SI;
+  }
+  return 0;
+}
+
+/// mergeStores - Replaces stores to one address that end every predecessor
+/// of J by a single store of a PHI at the top of J.
+bool SPGVNPDE::mergeStores(BasicBlock* J, AAResults& AA, DominatorTree& DT) {
+  if (J->isEHPad() || pred_size(J) < 2)
+    return false;
+  for (BasicBlock* P : predecessors(J))
+    if (P->getSingleSuccessor() != J)
+      return false;
+
+  // Any store that nothing follows in the first predecessor may be the one
+  StoreInst* first = 0;
+  DenseMap<BasicBlock*, StoreInst*> stores;
+  BasicBlock* P0 = *pred_begin(J);
+  for (auto it = P0->rbegin(); it != P0->rend() && !first; ++it) {
+    StoreInst* SI = dyn_cast<StoreInst>(&*it);
+    if (!SI || lastStoreTo(P0, SI->getPointerOperand(), AA) != SI)
+      continue;
+    Value* ptr = SI->getPointerOperand();
+    if (Instruction* ptrI = dyn_cast<Instruction>(ptr))
+      if (!DT.properlyDominates(ptrI->getParent(), J))
+        continue;
+
+    first = SI;
+    stores.clear();
+    for (BasicBlock* P : predecessors(J)) {
+      StoreInst* last = lastStoreTo(P, ptr, AA);
+      if (!last || last->getValueOperand()->getType() != SI->getValueOperand()->getType()) {
+        first = 0;
+        break;
+      }
+      stores[P] = last;
+    }
+  }
+  if (!first)
+    return false;
+  Value* ptr = first->getPointerOperand();
+
+  Value* value = first->getValueOperand();
+  Align align = first->getAlign();
+  for (auto& entry : stores) {
+    align = std::min(align, entry.second->getAlign());
+    if (entry.second->getValueOperand() != value)
+      value = 0;
+  }
+  if (!value) {
+    PHINode* phi = PHINode::Create(first->getValueOperand()->getType(), pred_size(J),
+                                   first->getValueOperand()->getName()+".merge", &J->front());
+    for (BasicBlock* P : predecessors(J))
+      phi->addIncoming(stores[P]->getValueOperand(), P);
+    value = phi;
+  }
+
+  StoreInst* merged = new StoreInst(value, ptr, false, align, &*J->getFirstInsertionPt());
+  errs() << "merge stores into " << *merged << "\n";
+  for (auto& entry : stores)
+    entry.second->eraseFromParent();
+  return true;
+}
+
+/// sinkStore - Deletes SI when the same address is overwritten on every
+/// path before it is read, or moves it onto the cut edges between its block
+/// and the blocks that may observe it, which include every block that leaves
+/// the function or is not dominated by SI.
+bool SPGVNPDE::sinkStore(StoreInst* SI, AAResults& AA, DominatorTree& DT,
+                         BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi,
+                         TargetTransformInfo& TTI) {
+  if (!SI->isSimple())
+    return false;
+  BasicBlock* D = SI->getParent();
+  Function& F = *D->getParent();
+  MemoryLocation Loc = MemoryLocation::get(SI);
+
+  // 0 if B leaves the location alone, 1 if it overwrites it before anything
+  // else touches it, 2 if the stored value may be observed
+  enum { Untouched, Overwritten, Observed };
+  auto firstAccess = [&](BasicBlock::iterator it, BasicBlock* B) {
+    for (; it != B->end(); ++it) {
+      Instruction* J = &*it;
+      StoreInst* K = dyn_cast<StoreInst>(J);
+      if (K && K->isSimple() && K->getPointerOperand() == SI->getPointerOperand() &&
+          K->getValueOperand()->getType() == SI->getValueOperand()->getType())
+        return Overwritten;
+      if (J->mayThrow() || isModOrRefSet(AA.getModRefInfo(J, Loc)))
+        return Observed;
+    }
+    return succ_empty(B) ? Observed : Untouched;
+  };
+  if (firstAccess(std::next(SI->getIterator()), D) != Untouched)
+    return false;
+
+  // Blocks that leave the location alone and are only entered from D or
+  // from each other. A copy on an edge out of them runs on no path where SI
+  // was overwritten or did not run. Every other block needs SI on entry,
+  // unless it overwrites the location first.
+  DenseMap<BasicBlock*, int> access;
+  SmallPtrSet<BasicBlock*, 16> region;
+  SmallVector<BasicBlock*, 16> worklist;
+  access[D] = firstAccess(D->begin(), D);
+  // Around a cycle through D a pointer computed in D names another address
+  Instruction* ptrDef = dyn_cast<Instruction>(SI->getPointerOperand());
+  if (access[D] == Overwritten && ptrDef && ptrDef->getParent() == D)
+    access[D] = Observed;
+  worklist.push_back(D);
+  while (!worklist.empty()) {
+    BasicBlock* B = worklist.pop_back_val();
+    for (BasicBlock* S : successors(B)) {
+      if (access.count(S))
+        continue;
+      access[S] = DT.dominates(D, S) ? firstAccess(S->begin(), S) : Observed;
+      if (access[S] == Untouched) {
+        region.insert(S);
+        worklist.push_back(S);
+      }
+    }
+  }
+  bool shrunk = true;
+  while (shrunk) {
+    shrunk = false;
+    SmallVector<BasicBlock*, 4> entered;
+    for (BasicBlock* B : region)
+      for (BasicBlock* P : predecessors(B))
+        if (P != D && !region.count(P)) {
+          entered.push_back(B);
+          break;
+        }
+    for (BasicBlock* B : entered) {
+      region.erase(B);
+      access[B] = Observed;
+      shrunk = true;
+    }
+  }
+  // Reaching D again before the location is overwritten would need a copy
+  // in front of the source of the flow graph
+  if (access[D] == Observed)
+    return false;
+
+  vector<pair<BasicBlock*, BasicBlock*>> edges;
+  bool observed = false;
+  worklist.push_back(D);
+  for (BasicBlock* B : region)
+    worklist.push_back(B);
+  for (BasicBlock* B : worklist) {
+    SmallPtrSet<BasicBlock*, 4> seen;
+    for (BasicBlock* S : successors(B)) {
+      if (!seen.insert(S).second || access[S] == Overwritten)
+        continue;
+      edges.push_back(pair<BasicBlock*, BasicBlock*>(B, S));
+      observed |= access[S] == Observed;
+    }
+  }
+
+  if (!observed) {
+    errs() << "delete overwritten store " << *SI << "\n";
+    SI->eraseFromParent();
+    return true;
+  }
+
+  ExprCost cost;
+  if (TTICost) {
+    vector<Value*> values(1, SI);
+    cost = expressionCost(values, TTI, F.hasOptSize());
+  }
+  ReducedFlowGraph RFG(edges, bpi, bfi, &F.getEntryBlock(), cost);
+  vector<pair<BasicBlock*, BasicBlock*>> cut = RFG.minCut();
+  if (cut.empty() || !worthSinking(D, cut, bpi, bfi) || !placeable(cut))
+    return false;
+
+  errs() << "sink " << *SI << " from " << D->getName() << " to";
+  for (auto edge : cut)
+    placeOnEdge(SI->clone(), edge);
+  errs() << "\n";
+  SI->eraseFromParent();
+  return true;
+}
+
+bool SPGVNPDE::runOnFunction(Function &F) {
+  errs() << F.getName() << " sinking\n";
+  TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+  TargetLibraryInfo &TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+  AssumptionCache &AC = getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F);
+
+  // The dominator tree, and the profile whenever sinking split edges, are
+  // recomputed here, so alias analysis is built on the local tree
+  DominatorTree DT(F);
+  LoopInfo LI;
+  BranchProbabilityInfo bpi;
+  BlockFrequencyInfo bfi;
+  BasicAAResult BAR(F.getParent()->getDataLayout(), F, TLI, AC, &DT);
+  AAResults AA(TLI);
+  AA.addAAResult(BAR);
+  bool stale = true;
+  bool changed = false;
+
+  if (StoreSinking)
+    for (BasicBlock& BB : F)
+      while (mergeStores(&BB, AA, DT))
+        changed = true;
+
+  // Users are visited before the values they use, so a chain of partially
+  // dead computations sinks together
+  vector<Instruction*> candidates;
+  for (BasicBlock* BB : post_order(&F.getEntryBlock()))
+    for (Instruction& I : reverse(*BB))
+      candidates.push_back(&I);
+
+  for (Instruction* I : candidates) {
+    StoreInst* SI = dyn_cast<StoreInst>(I);
+    if (!(SI && StoreSinking) && !sinkable(I))
+      continue;
+    if (stale) {
+      DT.recalculate(F);
+      LI.releaseMemory();
+      LI.analyze(DT);
+      bpi.calculate(F, LI, nullptr, &DT, nullptr);
+      bfi.calculate(F, bpi, LI);
+      stale = false;
+    }
+    if (SI ? sinkStore(SI, AA, DT, bpi, bfi, TTI) : sink(I, bpi, bfi, TTI))
+      changed = stale = true;
+  }
+
+  // Sunk stores may now end both arms of a diamond
+  if (StoreSinking && changed) {
+    DT.recalculate(F);
+    for (BasicBlock& BB : F)
+      while (mergeStores(&BB, AA, DT))
+        changed = true;
+  }
+  return changed;
+}
+
+char SPGVNPDE::ID = 0;
+
+static RegisterPass<SPGVNPDE> Y("spgvnpde",
+                      "SPeculative Partial Dead code Elimination by min-cut sinking");
+
+
+#undef DEBUG_TYPE
+#define DEBUG_TYPE "spgvnsb"
+
+namespace {
+  /// SPGVNSB - Superblock formation ahead of SPGVNPRE. A block joined by a
+  /// hot and by cold predecessors is duplicated for the cold ones, so the
+  /// hot trace enters it only from the hot side. Redundancies that were
+  /// only full along the hot trace then become full redundancies, which
+  /// SPGVNPRE removes without a PHI at the join. Duplication stops at
+  /// -spgvnsb-budget instructions per function.
+  ///
+  /// Loop versioning (-spgvnsb-version-loops) applies the same idea to a
+  /// whole loop: when the header PHIs of a loop only change on rare edges,
+  /// the loop gets a fast copy in which those edges leave to the original
+  /// loop, so the PHIs and everything computed from them are invariant in
+  /// the copy and SPGVNPRE hoists them.
+  class SPGVNSB : public FunctionPass {
+    bool runOnFunction(Function &F);
+  public:
+    static char ID; // Pass identification, replacement for typeid
+    SPGVNSB() : FunctionPass(ID) {}
+  private:
+    bool duplicable(BasicBlock* M);
+    void duplicateTail(BasicBlock* M, BasicBlock* H);
+    bool rareEdges(Loop* L, BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi,
+                   vector<pair<BasicBlock*, BasicBlock*>>& edges);
+    BasicBlock* versionLoop(Loop* L, vector<pair<BasicBlock*, BasicBlock*>>& edges);
+  };
+}
+
+/// duplicable - Whether M may get a copy: no EH, no address taken, no
+/// instruction that must not be duplicated, and preds that can be
+/// redirected.
+bool SPGVNSB::duplicable(BasicBlock* M) {
+  if (M->isEHPad() || M->hasAddressTaken() ||
+      (!isa<BranchInst>(M->getTerminator()) && !isa<ReturnInst>(M->getTerminator()) &&
+       !isa<SwitchInst>(M->getTerminator())))
+    return false;
+  for (BasicBlock* P : predecessors(M))
+    if (isa<IndirectBrInst>(P->getTerminator()) || isa<CallBrInst>(P->getTerminator()))
+      return false;
+  for (Instruction& I : *M) {
+    if (I.getType()->isTokenTy())
+      return false;
+    if (CallBase* CB = dyn_cast<CallBase>(&I))
+      if (CB->cannotDuplicate() || CB->isConvergent())
+        return false;
+  }
+  return true;
+}
+
+/// duplicateTail - Gives every predecessor of M except H a copy of M, and
+/// merges M and the copy into their predecessors when those have no other
+/// successor.
+void SPGVNSB::duplicateTail(BasicBlock* M, BasicBlock* H) {
+  ValueToValueMapTy VMap;
+  BasicBlock* copy = CloneBasicBlock(M, VMap, ".sb", M->getParent());
+  for (Instruction& I : *copy)
+    RemapInstruction(&I, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+
+  // M keeps the incoming values of H, the copy those of the rest
+  for (PHINode& P : M->phis()) {
+    PHINode* Q = cast<PHINode>(VMap[&P]);
+    for (int i = P.getNumIncomingValues()-1; i >= 0; i--)
+      if (P.getIncomingBlock(i) != H)
+        P.removeIncomingValue(i, false);
+    for (int i = Q->getNumIncomingValues()-1; i >= 0; i--)
+      if (Q->getIncomingBlock(i) == H)
+        Q->removeIncomingValue(i, false);
+  }
+  SmallPtrSet<BasicBlock*, 4> cold;
+  for (BasicBlock* P : predecessors(M))
+    if (P != H)
+      cold.insert(P);
+  for (BasicBlock* P : cold)
+    P->getTerminator()->replaceSuccessorWith(M, copy);
+
+  // The successors of M are entered from the copy as well
+  SmallPtrSet<BasicBlock*, 4> succs;
+  for (BasicBlock* S : successors(M)) {
+    if (!succs.insert(S).second)
+      continue;
+    for (PHINode& P : S->phis()) {
+      SmallVector<Value*, 2> fromM;
+      for (unsigned i = 0; i < P.getNumIncomingValues(); i++)
+        if (P.getIncomingBlock(i) == M)
+          fromM.push_back(P.getIncomingValue(i));
+      for (Value* V : fromM)
+        P.addIncoming(VMap.count(V) ? (Value*)VMap[V] : V, copy);
+    }
+  }
+
+  // Values of M used past it now come from M or from the copy
+  for (Instruction& I : *M) {
+    SmallVector<Use*, 8> outside;
+    for (Use& U : I.uses()) {
+      Instruction* user = cast<Instruction>(U.getUser());
+      BasicBlock* UB = user->getParent();
+      if (PHINode* P = dyn_cast<PHINode>(user))
+        UB = P->getIncomingBlock(U);
+      if (UB != M)
+        outside.push_back(&U);
+    }
+    if (outside.empty())
+      continue;
+    SSAUpdater SSA;
+    SSA.Initialize(I.getType(), I.getName());
+    SSA.AddAvailableValue(M, &I);
+    SSA.AddAvailableValue(copy, VMap[&I]);
+    for (Use* U : outside)
+      SSA.RewriteUse(*U);
+  }
+
+  // FoldSingleEntryPHINodes takes the first incoming value whatever the
+  // number of predecessors, so the copy is only folded when it has one
+  FoldSingleEntryPHINodes(M);
+  if (copy->getSinglePredecessor())
+    FoldSingleEntryPHINodes(copy);
+  MergeBlockIntoPredecessor(M);
+  MergeBlockIntoPredecessor(copy);
+}
+
+/// rareEdges - Collects the edges on which a header PHI of L takes a new
+/// value, for every PHI that is carried around the loop unchanged, directly
+/// or through other PHIs of the loop, on all other paths, is used by more
+/// than PHIs, and changes at most -spgvnsb-rare-percent as often as the
+/// header runs. Returns true if any PHI qualifies.
+bool SPGVNSB::rareEdges(Loop* L, BranchProbabilityInfo& bpi, BlockFrequencyInfo& bfi,
+                        vector<pair<BasicBlock*, BasicBlock*>>& edges) {
+  BasicBlock* header = L->getHeader();
+  uint64_t headerFreq = bfi.getBlockFreq(header).getFrequency();
+  for (PHINode& P : header->phis()) {
+    bool used = false;
+    for (User* U : P.users())
+      used |= !isa<PHINode>(U) && L->contains(cast<Instruction>(U));
+    if (!used)
+      continue;
+
+    // Follows the value carried back to the header to where it is not P
+    vector<pair<BasicBlock*, BasicBlock*>> redefs;
+    SmallPtrSet<PHINode*, 8> visited;
+    std::function<void(Value*, BasicBlock*, BasicBlock*)> carried =
+      [&](Value* V, BasicBlock* from, BasicBlock* to) {
+      if (V == &P)
+        return;
+      PHINode* Q = dyn_cast<PHINode>(V);
+      if (Q && Q->getParent() != header && L->contains(Q)) {
+        if (visited.insert(Q).second)
+          for (unsigned i = 0; i < Q->getNumIncomingValues(); i++)
+            carried(Q->getIncomingValue(i), Q->getIncomingBlock(i), Q->getParent());
+        return;
+      }
+      redefs.push_back(pair<BasicBlock*, BasicBlock*>(from, to));
+    };
+    for (unsigned i = 0; i < P.getNumIncomingValues(); i++)
+      if (L->contains(P.getIncomingBlock(i)))
+        carried(P.getIncomingValue(i), P.getIncomingBlock(i), header);
+    if (redefs.empty())
+      continue;
+
+    uint64_t redefFreq = 0;
+    for (auto edge : redefs)
+      redefFreq = SaturatingAdd(redefFreq, bpi.getEdgeProbability(edge.first, edge.second)
+                                  .scale(bfi.getBlockFreq(edge.first).getFrequency()));
+    LLVM_DEBUG(dbgs() << "phi " << P.getName() << " redefined " << redefFreq
+                      << " / " << headerFreq << "\n");
+    if (redefFreq*100 > headerFreq*RarePercent)
+      continue;
+    for (auto edge : redefs)
+      if (std::find(edges.begin(), edges.end(), edge) == edges.end())
+        edges.push_back(edge);
+  }
+  return !edges.empty();
+}
+
+/// versionLoop - Enters a copy of L from the preheader instead of L. The
+/// copy leaves to the original loop on the given edges, and the original
+/// loop runs to its exits from there. An edge that does not end at the
+/// header leaves to a tail instead, a third copy of the blocks from there
+/// to the latches, whose back edges go to the original header. So L keeps
+/// its single entry. Values of L are merged with those of the copies by
+/// SSAUpdater wherever they meet. Returns the header of the copy.
+BasicBlock* SPGVNSB::versionLoop(Loop* L, vector<pair<BasicBlock*, BasicBlock*>>& edges) {
+  BasicBlock* preheader = L->getLoopPreheader();
+  BasicBlock* header = L->getHeader();
+  Function& F = *header->getParent();
+  vector<BasicBlock*> blocks(L->block_begin(), L->block_end());
+
+  ValueToValueMapTy VMap;
+  for (BasicBlock* B : blocks)
+    VMap[B] = CloneBasicBlock(B, VMap, ".ver", &F);
+  for (BasicBlock* B : blocks)
+    for (Instruction& I : *cast<BasicBlock>(VMap[B]))
+      RemapInstruction(&I, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+  auto mapped = [&](Value* V) { return VMap.count(V) ? (Value*)VMap[V] : V; };
+
+  preheader->getTerminator()->replaceSuccessorWith(header, cast<BasicBlock>(VMap[header]));
+  for (PHINode& P : header->phis())
+    P.removeIncomingValue(preheader, false);
+
+  // Adds the incoming values of the edge from B for the copy of B
+  auto enterFromCopy = [&](BasicBlock* B, BasicBlock* S) {
+    for (PHINode& P : S->phis()) {
+      SmallVector<Value*, 2> fromB;
+      for (unsigned i = 0; i < P.getNumIncomingValues(); i++)
+        if (P.getIncomingBlock(i) == B)
+          fromB.push_back(P.getIncomingValue(i));
+      for (Value* V : fromB)
+        P.addIncoming(mapped(V), cast<BasicBlock>(VMap[B]));
+    }
+  };
+  for (BasicBlock* B : blocks) {
+    SmallPtrSet<BasicBlock*, 4> exits;
+    for (BasicBlock* S : successors(B))
+      if (!L->contains(S) && exits.insert(S).second)
+        enterFromCopy(B, S);
+  }
+
+  // The tail holds what the rest of an iteration can run after a rare edge
+  // into the body. It is only entered from the copy, so values from before
+  // the edge are those of the copy.
+  SmallPtrSet<BasicBlock*, 8> inTail;
+  SmallVector<BasicBlock*, 8> tail;
+  for (auto edge : edges)
+    if (edge.second != header && inTail.insert(edge.second).second)
+      tail.push_back(edge.second);
+  for (unsigned i = 0; i < tail.size(); i++)
+    for (BasicBlock* S : successors(tail[i]))
+      if (S != header && L->contains(S) && inTail.insert(S).second)
+        tail.push_back(S);
+  ValueToValueMapTy TMap;
+  for (BasicBlock* B : blocks) {
+    TMap[B] = VMap[B];
+    for (Instruction& I : *B)
+      TMap[&I] = VMap[&I];
+  }
+  for (BasicBlock* B : tail)
+    TMap[B] = CloneBasicBlock(B, TMap, ".tail", &F);
+  TMap[header] = header;
+  for (BasicBlock* B : tail)
+    for (Instruction& I : *cast<BasicBlock>(TMap[B]))
+      RemapInstruction(&I, TMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+  auto tailMapped = [&](Value* V) { return TMap.count(V) ? (Value*)TMap[V] : V; };
+
+  for (auto edge : edges) {
+    BasicBlock* BC = cast<BasicBlock>(VMap[edge.first]);
+    BasicBlock* SC = cast<BasicBlock>(VMap[edge.second]);
+    BasicBlock* to = cast<BasicBlock>(TMap[edge.second]);
+    BC->getTerminator()->replaceSuccessorWith(SC, to);
+    for (PHINode& P : SC->phis())
+      for (int i = P.getNumIncomingValues()-1; i >= 0; i--)
+        if (P.getIncomingBlock(i) == BC)
+          P.removeIncomingValue(i, false);
+    if (to == header)
+      enterFromCopy(edge.first, edge.second);
+  }
+
+  // The tail blocks keep the incoming values of the edges that still reach
+  // them, and leave to the header and the exits like the blocks they copy
+  for (BasicBlock* B : tail) {
+    BasicBlock* BT = cast<BasicBlock>(TMap[B]);
+    SmallPtrSet<BasicBlock*, 4> preds(pred_begin(BT), pred_end(BT));
+    for (PHINode& P : BT->phis())
+      for (int i = P.getNumIncomingValues()-1; i >= 0; i--)
+        if (!preds.count(P.getIncomingBlock(i)))
+          P.removeIncomingValue(i, false);
+    SmallPtrSet<BasicBlock*, 4> succs;
+    for (BasicBlock* S : successors(B)) {
+      if (inTail.count(S) || !succs.insert(S).second)
+        continue;
+      for (PHINode& P : S->phis()) {
+        SmallVector<Value*, 2> fromB;
+        for (unsigned i = 0; i < P.getNumIncomingValues(); i++)
+          if (P.getIncomingBlock(i) == B)
+            fromB.push_back(P.getIncomingValue(i));
+        for (Value* V : fromB)
+          P.addIncoming(tailMapped(V), BT);
+      }
+    }
+  }
+
+  for (BasicBlock* B : blocks) {
+    for (Instruction& I : *B) {
+      SmallVector<Use*, 8> outside;
+      for (Use& U : I.uses()) {
+        Instruction* user = cast<Instruction>(U.getUser());
+        BasicBlock* UB = user->getParent();
+        if (PHINode* P = dyn_cast<PHINode>(user))
+          UB = P->getIncomingBlock(U);
+        if (UB != B)
+          outside.push_back(&U);
+      }
+      if (outside.empty())
+        continue;
+      SSAUpdater SSA;
+      SSA.Initialize(I.getType(), I.getName());
+      SSA.AddAvailableValue(B, &I);
+      SSA.AddAvailableValue(cast<BasicBlock>(VMap[B]), VMap[&I]);
+      if (inTail.count(B))
+        SSA.AddAvailableValue(cast<BasicBlock>(TMap[B]), TMap[&I]);
+      for (Use* U : outside)
+        SSA.RewriteUse(*U);
+    }
+  }
+
+  // The PHIs that only changed on the removed edges fold away in the copy,
+  // along with whatever folds once they are known
+  const DataLayout& DL = F.getParent()->getDataLayout();
+  bool folded = true;
+  while (folded) {
+    folded = false;
+    for (BasicBlock* B : blocks)
+      for (Instruction& I : make_early_inc_range(*cast<BasicBlock>(VMap[B])))
+        if (Value* V = SimplifyInstruction(&I, SimplifyQuery(DL, &I))) {
+          I.replaceAllUsesWith(V);
+          if (isInstructionTriviallyDead(&I))
+            I.eraseFromParent();
+          folded = true;
+        }
+  }
+  removeUnreachableBlocks(F);
+  return cast<BasicBlock>(VMap[header]);
+}
+
+bool SPGVNSB::runOnFunction(Function &F) {
+  LLVM_DEBUG(dbgs() << F.getName() << " superblocks\n");
+  int budget = SuperblockBudget;
+  bool changed = false;
+
+  // Versioned loops and their copies are not versioned again
+  SmallPtrSet<BasicBlock*, 8> versioned;
+  while (VersionLoops) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo bpi(F, LI, nullptr, &DT, nullptr);
+    BlockFrequencyInfo bfi(F, bpi, LI);
+
+    Loop* best = 0;
+    vector<pair<BasicBlock*, BasicBlock*>> bestEdges;
+    int bestSize = 0;
+    SmallVector<Loop*, 4> loops = LI.getLoopsInPreorder();
+    for (Loop* L : reverse(loops)) {
+      if (!L->getLoopPreheader() || versioned.count(L->getHeader()))
+        continue;
+      int size = 0;
+      bool ok = true;
+      for (BasicBlock* B : L->blocks()) {
+        size += B->size();
+        ok &= duplicable(B);
+      }
+      vector<pair<BasicBlock*, BasicBlock*>> edges;
+      if (ok && size <= budget && rareEdges(L, bpi, bfi, edges)) {
+        best = L;
+        bestEdges = edges;
+        bestSize = size;
+        break;
+      }
+    }
+    if (!best)
+      break;
+
+    LLVM_DEBUG(dbgs() << "version loop " << best->getHeader()->getName() << "\n");
+    budget -= bestSize;
+    versioned.insert(best->getHeader());
+    versioned.insert(versionLoop(best, bestEdges));
+    changed = true;
+  }
+
+  // Every duplication changes the CFG, so the profile is recomputed and the
+  // hottest remaining merge is duplicated next
+  while (true) {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo bpi(F, LI, nullptr, &DT, nullptr);
+    BlockFrequencyInfo bfi(F, bpi, LI);
+
+    BasicBlock* best = 0;
+    BasicBlock* bestHot = 0;
+    uint64_t bestFreq = 0;
+    for (BasicBlock& M : F) {
+      if (pred_size(&M) < 2 || LI.isLoopHeader(&M) || (int)M.size() > budget ||
+          !duplicable(&M))
+        continue;
+      uint64_t freq = bfi.getBlockFreq(&M).getFrequency();
+      BasicBlock* hot = 0;
+      uint64_t hotFreq = 0;
+      for (BasicBlock* P : predecessors(&M)) {
+        uint64_t edgeFreq = bpi.getEdgeProbability(P, &M)
+                              .scale(bfi.getBlockFreq(P).getFrequency());
+        if (edgeFreq > hotFreq) {
+          hot = P;
+          hotFreq = edgeFreq;
+        }
+      }
+      if (hotFreq*100 < freq*SuperblockHotPercent || hotFreq >= freq ||
+          hotFreq <= bestFreq)
+        continue;
+      best = &M;
+      bestHot = hot;
+      bestFreq = hotFreq;
+    }
+    if (!best)
+      break;
+
+    LLVM_DEBUG(dbgs() << "duplicate " << best->getName() << " off the trace through "
+                      << bestHot->getName() << "\n");
+    budget -= best->size();
+    duplicateTail(best, bestHot);
+    changed = true;
+  }
+  return changed;
+}
+
+char SPGVNSB::ID = 0;
+
+static RegisterPass<SPGVNSB> Z("spgvnsb",
+                      "SPGVNPRE superblock formation by profile-guided tail duplication");
+
+namespace {
+  /// SPGVNCO - Outlining of the cold compensation blocks that SPGVNPRE
+  /// tagged under -spgvnpre-outline-cold. CodeExtractor adds a function to
+  /// the module, which a FunctionPass must not do, so this runs as a
+  /// ModulePass after SPGVNPRE. Outlined functions are cold, noinline and
+  /// carry "spgvnpre-outlined", which SPGVNPRE skips.
+  class SPGVNCO : public ModulePass {
+    bool runOnModule(Module &M) override;
+  public:
+    static char ID; // Pass identification, replacement for typeid
+    SPGVNCO() : ModulePass(ID) {}
+  private:
+    bool outlineCold(BasicBlock* BB);
+  };
+}
+
+/// outlineCold - Move the code of the cold block BB into a cold noinline
+/// function. Returns false if BB cannot be extracted.
+bool SPGVNCO::outlineCold(BasicBlock* BB){
+  if(BB->size() < 2)
+    return false;
+  Function& F = *BB->getParent();
+  CodeExtractorAnalysisCache CEAC(F);
+  CodeExtractor CE(BB);
+  if(!CE.isEligible())
+    return false;
+  Function* outlined = CE.extractCodeRegion(CEAC);
+  if(!outlined)
+    return false;
+  outlined->addFnAttr(Attribute::Cold);
+  outlined->addFnAttr(Attribute::NoInline);
+  outlined->addFnAttr("spgvnpre-outlined");
+  CallInst* call = cast<CallInst>(outlined->user_back());
+  call->addFnAttr(Attribute::Cold);
+  return true;
+}
+
+bool SPGVNCO::runOnModule(Module &M) {
+  // Collect first, outlining adds functions to M
+  SmallVector<BasicBlock*, 8> cold;
+  for(Function& F : M)
+    for(BasicBlock& BB : F)
+      if(BB.getTerminator() && BB.getTerminator()->getMetadata("spgvnpre.cold")){
+        BB.getTerminator()->setMetadata("spgvnpre.cold", nullptr);
+        cold.push_back(&BB);
+      }
+  bool changed = !cold.empty();
+  for(BasicBlock* BB : cold)
+    outlineCold(BB);
+  return changed;
+}
+
+char SPGVNCO::ID = 0;
+
+static RegisterPass<SPGVNCO> C("spgvnco",
+                      "Outline the cold compensation blocks tagged by SPGVNPRE");
@@ -0,0 +1,55 @@
+#!/bin/bash
+### cutcompare.sh
+### compares the earliest and the latest minimum cut of spgvnpre
+### usage: ./cutcompare.sh ${benchmark_name}
+### e.g., ./cutcompare.sh hw2perf1
+### Spill counts come from the register allocator remarks of llc, runtime from lli.
+
+PATH_MYPASS=../build/SPGVNPRE/LLVMHW2.so ### Action Required: Specify the path to your pass ###
+NAME_MYPASS=-spgvnpre ### Action Required: Specify the name for your pass ###
+BENCH=../test/${1}.c
+TIME_MEASURE=../res/${1}_cut.txt
+
+mkdir -p ${1}
+mkdir -p ../res
+rm ${1}/*
+
+# Convert source code to bitcode (IR)
+clang -Xclang -disable-O0-optnone -emit-llvm -c ${BENCH} -o ${1}/${1}.bc
+opt -mem2reg ${1}/${1}.bc -o ${1}/${1}_reg.bc
+
+# Collect profiling data
+opt -pgo-instr-gen -instrprof ${1}/${1}_reg.bc -o ${1}/${1}.prof.bc
+clang -fprofile-instr-generate ${1}/${1}.prof.bc -o ${1}/${1}.prof
+${1}/${1}.prof > ${1}/correct_output
+llvm-profdata merge -output=pgo.profdata default.profraw
+
+echo -e "Cut comparison for ${1}" > ${TIME_MEASURE}
+
+for CUT in early late; do
+  FLAGS=""
+  if [[ ${CUT} == "late" ]]; then
+    FLAGS="-spgvnpre-late-cut"
+  fi
+
+  opt -enable-new-pm=0 -o ${1}/${1}_${CUT}.bc -pgo-instr-use -pgo-test-profile-file=pgo.profdata -load ${PATH_MYPASS} ${NAME_MYPASS} ${FLAGS} < ${1}/${1}_reg.bc > /dev/null 2>&1
+  opt -dce ${1}/${1}_${CUT}.bc -o ${1}/${1}_${CUT}.bc
+
+  # Spills and reloads reported by the greedy register allocator. They are
+  # missed remarks, and the per-loop ones count the same spills again, so
+  # only the per-function totals are summed.
+  llc -O2 -pass-remarks-missed=regalloc ${1}/${1}_${CUT}.bc -o ${1}/${1}_${CUT}.s 2> ${1}/${1}_${CUT}.remarks
+  SPILLS=$(grep "generated in function" ${1}/${1}_${CUT}.remarks | grep -o "[0-9]\+ spills" | awk '{s+=$1} END {print s+0}')
+  RELOADS=$(grep "generated in function" ${1}/${1}_${CUT}.remarks | grep -o "[0-9]\+ reloads" | awk '{s+=$1} END {print s+0}')
+
+  echo -e "\n\n\n${CUT} cut" >> ${TIME_MEASURE}
+  echo -e "   spills ${SPILLS} reloads ${RELOADS}" >> ${TIME_MEASURE}
+  echo -e "\n\n   run" >> ${TIME_MEASURE}
+  { time lli ${1}/${1}_${CUT}.bc > ${1}/${CUT}_output; } 2>> ${TIME_MEASURE}
+
+  if ! cmp -s ${1}/correct_output ${1}/${CUT}_output; then
+    echo -e "   output mismatch" >> ${TIME_MEASURE}
+  fi
+done
+
+rm -f default.profraw
@@ -0,0 +1,58 @@
+#!/bin/bash
+### vectorize.sh
+### checks that spgvnpre leaves the loops of a benchmark vectorizable
+### usage: ./vectorize.sh ${benchmark_name}
+### e.g., ./vectorize.sh Bubblesort
+### The loop vectorizer runs right after the pass, without the cleanup of -O2,
+### and its remarks are counted for the plain, the default and the
+### vectorizer-friendly spgvnpre.
+
+PATH_MYPASS=../build/SPGVNPRE/LLVMHW2.so ### Action Required: Specify the path to your pass ###
+NAME_MYPASS=-spgvnpre ### Action Required: Specify the name for your pass ###
+BENCH=../test/${1}.c
+TIME_MEASURE=../res/${1}_vectorize.txt
+TARGET="-mtriple=x86_64-unknown-linux-gnu -mcpu=haswell"
+
+mkdir -p ${1}
+mkdir -p ../res
+rm ${1}/*
+
+# Convert source code to bitcode (IR)
+clang -Xclang -disable-O0-optnone -emit-llvm -c ${BENCH} -o ${1}/${1}.bc
+opt -mem2reg ${1}/${1}.bc -o ${1}/${1}_reg.bc
+
+# Collect profiling data
+opt -pgo-instr-gen -instrprof ${1}/${1}_reg.bc -o ${1}/${1}.prof.bc
+clang -fprofile-instr-generate ${1}/${1}.prof.bc -o ${1}/${1}.prof
+${1}/${1}.prof > ${1}/correct_output
+llvm-profdata merge -output=pgo.profdata default.profraw
+
+echo -e "Vectorization for ${1}" > ${TIME_MEASURE}
+
+for MODE in reg spgvn friendly; do
+  if [[ ${MODE} == "reg" ]]; then
+    cp ${1}/${1}_reg.bc ${1}/${1}_${MODE}.bc
+  else
+    FLAGS=""
+    if [[ ${MODE} == "friendly" ]]; then
+      FLAGS="-spgvnpre-vectorizer-friendly"
+    fi
+    opt -enable-new-pm=0 -o ${1}/${1}_${MODE}.bc -pgo-instr-use -pgo-test-profile-file=pgo.profdata -load ${PATH_MYPASS} ${NAME_MYPASS} ${FLAGS} < ${1}/${1}_reg.bc > /dev/null 2>&1
+  fi
+
+  # Loops the vectorizer takes and the reasons it gives for the others
+  opt ${TARGET} -loop-simplify -lcssa -loop-rotate -loop-vectorize -pass-remarks=loop-vectorize -pass-remarks-missed=loop-vectorize -pass-remarks-analysis=loop-vectorize ${1}/${1}_${MODE}.bc -o ${1}/${1}_${MODE}_vec.bc 2> ${1}/${1}_${MODE}.remarks
+  VECTORIZED=$(grep -c "vectorized loop" ${1}/${1}_${MODE}.remarks)
+
+  echo -e "\n\n\n${MODE}" >> ${TIME_MEASURE}
+  echo -e "   vectorized loops ${VECTORIZED}" >> ${TIME_MEASURE}
+  grep -o "loop not vectorized: .*" ${1}/${1}_${MODE}.remarks | sort | uniq -c >> ${TIME_MEASURE}
+  echo -e "\n\n   run" >> ${TIME_MEASURE}
+  { time lli ${1}/${1}_${MODE}_vec.bc > ${1}/${MODE}_output; } 2>> ${TIME_MEASURE}
+
+  if ! cmp -s ${1}/correct_output ${1}/${MODE}_output; then
+    echo -e "   output mismatch" >> ${TIME_MEASURE}
+  fi
+done
+
+rm -f default.profraw
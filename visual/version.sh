@@ -0,0 +1,58 @@
+#!/bin/bash
+### version.sh
+### measures the loop versioning of spgvnsb ahead of spgvnpre
+### usage: ./version.sh ${benchmark_name}
+### e.g., ./version.sh hw2perf1
+### The loop in hw2perf1 redefines j on a rare path. Versioning gives it a
+### copy in which j is invariant, so the joint min-cut hoists the loads of A[j]
+### and C[j] and what depends on them.
+
+PATH_MYPASS=../build/SPGVNPRE/LLVMHW2.so ### Action Required: Specify the path to your pass ###
+NAME_MYPASS="-spgvnpre -spgvnpre-joint-cut -spgvnpre-load-pre" ### Action Required: Specify the name for your pass ###
+BENCH=../test/${1}.c
+TIME_MEASURE=../res/${1}_version.txt
+
+mkdir -p ${1}
+mkdir -p ../res
+rm ${1}/*
+
+# Convert source code to bitcode (IR)
+clang -Xclang -disable-O0-optnone -emit-llvm -c ${BENCH} -o ${1}/${1}.bc
+opt -mem2reg ${1}/${1}.bc -o ${1}/${1}_reg.bc
+
+# Collect profiling data, versioning needs the rare edges to be known
+opt -pgo-instr-gen -instrprof ${1}/${1}_reg.bc -o ${1}/${1}.prof.bc
+clang -fprofile-instr-generate ${1}/${1}.prof.bc -o ${1}/${1}.prof
+${1}/${1}.prof > ${1}/correct_output
+llvm-profdata merge -output=pgo.profdata default.profraw
+
+echo -e "Loop versioning for ${1}" > ${TIME_MEASURE}
+
+for MODE in reg spgvn version; do
+  if [[ ${MODE} == "reg" ]]; then
+    cp ${1}/${1}_reg.bc ${1}/${1}_${MODE}.bc
+  else
+    FLAGS=""
+    if [[ ${MODE} == "version" ]]; then
+      FLAGS="-spgvnsb -spgvnsb-version-loops"
+    fi
+    opt -enable-new-pm=0 -o ${1}/${1}_${MODE}.bc -pgo-instr-use -pgo-test-profile-file=pgo.profdata -load ${PATH_MYPASS} ${FLAGS} ${NAME_MYPASS} < ${1}/${1}_reg.bc > /dev/null 2>&1
+    opt -dce ${1}/${1}_${MODE}.bc -o ${1}/${1}_${MODE}.bc
+  fi
+
+  # Versioned copies keep the names of their blocks with a .ver suffix
+  VERSIONED=$(opt -enable-new-pm=0 -loops -analyze ${1}/${1}_${MODE}.bc 2>&1 | grep -c "\.ver<header>")
+
+  echo -e "\n\n\n${MODE}" >> ${TIME_MEASURE}
+  echo -e "   versioned loops ${VERSIONED}" >> ${TIME_MEASURE}
+  echo -e "\n\n   compile" >> ${TIME_MEASURE}
+  { time clang ${1}/${1}_${MODE}.bc -o ${1}/${1}_${MODE}; } 2>> ${TIME_MEASURE}
+  echo -e "\n\n   run" >> ${TIME_MEASURE}
+  { time ${1}/${1}_${MODE} > ${1}/${MODE}_output; } 2>> ${TIME_MEASURE}
+
+  if ! cmp -s ${1}/correct_output ${1}/${MODE}_output; then
+    echo -e "   output mismatch" >> ${TIME_MEASURE}
+  fi
+done
+
+rm -f default.profraw